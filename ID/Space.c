@@ -14,6 +14,39 @@ int 	ata_intr_mode = 1;
 int 	atapi_intr_mode = 1;
 int	ata_debug_console = 0;
 
+/*
+ * Bounce buffer pool, allocated at boot and shared by the channels.
+ * A channel running an ATAPI request holds one; its size bounds the
+ * bytes per CDB.  ATA transfers go in place and take none.
+ */
+int	ata_bounce_bufsz = 128*1024;	/* bytes per buffer */
+int	ata_bounce_nbuf  = ATA_MAX_CTRL;	/* buffers (max ATA_BOUNCE_MAXBUF) */
+
+/*
+ * Skip taskfile register writes that would store the byte already
+ * there (ata_tf_out).  Set to 0 to write every register every command.
+ */
+int	ata_tf_shadow = 1;
+
+/*
+ * Leave biodone() and request release of commands finished in the
+ * interrupt handler to ata_done_run(), at timeout level on the next
+ * clock tick.  The deferred work touches no ports and no user
+ * addresses.  Shortens the time the disk holds SPL5, but there is no
+ * soft-interrupt level to run it sooner, so it adds up to a tick to
+ * every interrupt completion and is off by default; set to 1 where
+ * interrupt latency for other devices matters more than disk latency.
+ */
+int	ata_defer_done = 0;
+
+/*
+ * Interrupt mode: after issuing a command, spin on ALTSTATUS with
+ * INTRQ masked for a window learned from the unit's recent commands,
+ * at most this many usec, before unmasking and waiting for the
+ * interrupt.  0 always waits for the interrupt.
+ */
+int	ata_hybrid_max_us = 100;
+
 ata_ctrl_t ata_ctrl[ATA_MAX_CTRL] = {
 	{ 0x1F0, 14, ACF_NONE }, /* c0 (Primary)   */
 	{ 0x170, 15, ACF_PRESENT }, /* c1 (Secondary) */
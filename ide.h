@@ -29,6 +29,7 @@
 #include <sys/kmem.h>
 #include <sys/uio.h>
 #include <sys/file.h>
+#include <sys/open.h>
 #include <sys/cred.h>
 #include <sys/conf.h>
 #include <sys/ddi.h>
@@ -52,23 +53,32 @@
 
 #define EOK	0
 
+/*
+ * Absolute sector number on a unit.  Partition bases, requests and
+ * the taskfile carry 48 bits; a single slice (daddr_t b_blkno) and
+ * the ioctl offsets within one stay 32-bit.
+ */
+typedef unsigned long long ata_lba_t;
+#define ATA_LBA_LO(x)	((u32_t)(x))
+#define ATA_LBA_HI(x)	((u32_t)((x) >> 32))
+
 #define IKDB()	si86_call_demon()
 
 #define U2CTRLNO(X)		((X)->ctrl - &ata_ctrl[0])
 
 /* Minor layout (USL-style, extended) ----------
  * 15 14 12 12  11 10 09 08  07 06 05 04  03 02 01 00
- *                    +-+-+  +  +-+-+ +   +----+----+
- *                      |    |    |   |        |
- *                      |    |    |   |        +------- Slice
- *                      |    |    |   +---------------- Drive 
- *                      |    |    +-------------------- Controller
- *                      |    +------------------------- ABSDEV (Whole Disk)
- *                      +------------------------------ Partition
+ *                 +--+--+   +  +-+-+ +   +----+----+
+ *                    |      |    |   |        |
+ *                    |      |    |   |        +------- Slice
+ *                    |      |    |   +---------------- Drive 
+ *                    |      |    +-------------------- Controller
+ *                    |      +------------------------- ABSDEV (Whole Disk)
+ *                    +-------------------------------- Partition
  * Only Root can open ABSDEV() to give rw to entire disk irrepective
  * of slices but confined still to the partion map
  */
-#define BASEDEV(dev)	(dev_t)(((dev) & ~0x30F)|0xf)
+#define BASEDEV(dev)	(dev_t)(((dev) & ~0x70F)|0xf)
 #define ABSDEV(dev)	(BASEDEV(dev)|0x80)
 #define ISABSDEV(dev)	((dev)&0x80)
 
@@ -76,7 +86,7 @@
 #define ATA_CTRL(m)       (((getminor(m)) >> 5) & 0x03)
 #define ATA_DRIVE(m)      (((getminor(m)) >> 4) & 0x01)
 #define ATA_SLICE(m)	  ((getminor(m)) & ATA_WHOLE_PART_SLICE)
-#define ATA_PART(m)       (((getminor(m)) >> 8) & 0x03)
+#define ATA_PART(m)       (((getminor(m)) >> 8) & 0x07)
 
 /* Unit helpers: unit = ctrl*2 + drive */
 #define ATA_UNIT_FROM(c,d)   	(((c) << 1) | ((d) & 1))
@@ -96,6 +106,10 @@
 #define FAT12		0x01	
 #define FAT16		0x04	
 #define EXTDOS0		0x05
+#define EXTWIN		0x0F	/* extended, LBA */
+#define EXTLINUX	0x85
+#define EFI_PMBR	0xEE	/* protective MBR; fd[] entry taken from the GPT */
+#define ISEXTPART(t)	((t) == EXTDOS0 || (t) == EXTWIN || (t) == EXTLINUX)
 #define NTFS		0x07	
 #define DOSDATA0	0x56
 #define OTHEROS0	0x62
@@ -117,7 +131,9 @@
 
 #define ATA_PDLOC	29	/* Sector location of PDINFO */
 
-#define ATA_XFER_BUFSZ	(64*1024)	/* 64k */
+#define ATA_XFER_BUFSZ	(128*1024)	/* default bounce buffer size */
+#define ATA_XFER_MINSZ	(4*1024)
+#define ATA_BOUNCE_MAXBUF 16		/* upper bound on ata_bounce_nbuf */
 
 #define XFERINC(R) \
 	do { \
@@ -142,6 +158,12 @@
 #define ATA_MAX_UNITS	(ATA_MAX_CTRL*ATA_MAX_DRIVES)
 
 #define ATA_NPART 16
+#define ATA_NFDISK 8			/* primary + logical, or GPT entries */
+#define ATA_NMINOR (ATA_NFDISK*ATA_NPART)	/* minors per unit */
+/* Per-minor slot; the whole-disk node (p0s15|ABSDEV) gets its own, last */
+#define ATA_NMINIDX	(ATA_NMINOR+1)
+#define ATA_MINIDX(m)	(ISABSDEV(m) ? ATA_NMINOR : \
+			 ATA_PART(m)*ATA_NPART + ATA_SLICE(m))
 
 /* --- Unified controller flags --- */
 #define ACF_NONE            0x0000  
@@ -151,7 +173,6 @@
 #define ACF_POLL_RUNNING    0x0008  /* poll engine active */
 #define ACF_PENDING_KICK    0x0010  /* deferred kick requested */
 #define ACF_BUSY  	    0x0020  /* busy */
-#define ACF_CLOSING  	    0x0040  /* busy */
 #define ACF_IRQ_ON	    0x0080  /* Interupts Enabled */
 
 #define AC_HAS_FLAG(ac,f)   (((ac)->flags & (f)) != 0)
@@ -161,6 +182,11 @@
 #define ATA_RF_NEEDCOPY	0x0001
 #define ATA_RF_DONE	0x0002
 #define ATA_RF_CDB_SENT	0x0004
+#define ATA_RF_META	0x0008	/* write touches MBR/VTOC: drop cached tables */
+#define ATA_RF_NODATA	0x0010	/* READ VERIFY: no data phase */
+#define ATA_RF_ZEROSRC	0x0020	/* write: every sector from ata_zero_sec */
+#define ATA_RF_HYSPIN	0x0080	/* issued with INTRQ masked for ata_hy_spin() */
+#define ATA_RF_HYOK	0x0100	/* ide_start(): first command may spin */
 
 /* --- Unified device flags --- */
 #define UF_PRESENT		0x0001
@@ -175,6 +201,194 @@
 
 #define V_GETTYPE        (VIOC|20)        
 
+/*
+ * Private ATA disk ioctls.
+ */
+#define ATAIOC_BASE	 ('A'<<8)
+#define ATAIOC_GETCAPS   (ATAIOC_BASE | 0x01) /* ata_caps_t for the unit */
+#define ATAIOC_POOLSTAT  (ATAIOC_BASE | 0x02) /* ata_poolstat_t */
+#define ATAIOC_BATCH     (ATAIOC_BASE | 0x03) /* ata_batch_t */
+
+/*
+ * ATAIOC_BATCH: many (lba, count, buffer) segments per call, relative
+ * to the opened slice.  Segments are sorted, contiguous ones merged,
+ * and all of them queued before the caller waits.  Each segment's
+ * status comes back in place; the ioctl's return value is the number
+ * of failed segments.
+ */
+#define ATA_BATCH_WRITE		0x0001
+#define ATA_BATCH_MAXSEG	256	/* segments per call */
+#define ATA_BATCH_MAXSEC	2048	/* sectors per call (1MB) */
+#define ATA_BATCH_MAXRUN	256	/* sectors per merged request */
+
+typedef struct ata_seg {
+	u32_t	lba;		/* in: first sector */
+	u32_t	nsec;		/* in: sectors */
+	caddr_t	buf;		/* in: user buffer, nsec*512 bytes */
+	int	status;		/* out: 0 or errno */
+} ata_seg_t;
+
+typedef struct ata_batch {
+	int	flags;		/* ATA_BATCH_* */
+	int	nseg;
+	ata_seg_t *segs;
+} ata_batch_t;
+
+/*
+ * ATAIOC_SUBMIT / ATAIOC_REAP: asynchronous raw I/O.  SUBMIT queues one
+ * request and returns at once; REAP collects finished ones from the
+ * unit's completion ring, optionally sleeping until at least min of
+ * them are there.  Data is staged in the kernel and, for reads, copied
+ * out at reap time, so REAP only returns requests the calling process
+ * submitted through the same minor.
+ */
+#define ATAIOC_SUBMIT    (ATAIOC_BASE | 0x04) /* ata_aio_t */
+#define ATAIOC_REAP      (ATAIOC_BASE | 0x05) /* ata_reap_t */
+
+#define ATA_AIO_WRITE	0x0001
+#define ATA_AIO_MAX	16	/* outstanding + unreaped per unit */
+#define ATA_AIO_MAXSEC	256	/* sectors per request */
+
+typedef struct ata_aio {
+	int	flags;		/* ATA_AIO_* */
+	u32_t	lba;		/* first sector, relative to the slice */
+	u32_t	nsec;
+	caddr_t	buf;
+	u32_t	tag;		/* caller's cookie, echoed by REAP */
+} ata_aio_t;
+
+typedef struct ata_aiodone {
+	u32_t	tag;
+	int	status;		/* 0 or errno */
+	u32_t	resid;		/* bytes not transferred */
+} ata_aiodone_t;
+
+typedef struct ata_reap {
+	int	min;		/* in: sleep until this many are done */
+	int	max;		/* in: room in done[] */
+	int	n;		/* out: entries filled */
+	ata_aiodone_t *done;
+} ata_reap_t;
+
+/*
+ * ATAIOC_VERIFY: have the drive check a range of the slice with READ
+ * VERIFY SECTORS; no data crosses the bus.  Unreadable sectors come
+ * back in bad[], relative to the slice, and the scan carries on past
+ * each one until the range is done or bad[] is full.
+ */
+#define ATAIOC_VERIFY    (ATAIOC_BASE | 0x06) /* ata_verify_t */
+#define ATA_VERIFY_MAXBAD 256
+#define ATA_VERIFY_CHUNK  8192	/* sectors per command, bounds watchdog time */
+
+typedef struct ata_verify {
+	u32_t	lba;		/* in: first sector */
+	u32_t	nsec;		/* in: sectors */
+	int	maxbad;		/* in: room in bad[] */
+	int	nbad;		/* out: entries in bad[] */
+	u32_t	done;		/* out: sectors checked */
+	u32_t	*bad;
+} ata_verify_t;
+
+/*
+ * ATAIOC_ZERO: write zeros over a range of the slice.  The data comes
+ * from one shared kernel sector, so nothing is copied.
+ */
+#define ATAIOC_ZERO      (ATAIOC_BASE | 0x07) /* ata_zero_t */
+
+typedef struct ata_zero {
+	u32_t	lba;		/* first sector, relative to the slice */
+	u32_t	nsec;
+} ata_zero_t;
+
+/*
+ * ATAIOC_COPY: copy nsec sectors from the opened slice to another ATA
+ * slice (same or another unit) inside the driver.  Reads of the source
+ * run ahead of writes to the destination through ATA_COPY_NBUF kernel
+ * buffers, so on different channels both disks stay busy.  The
+ * destination must be open; the caller must be privileged.
+ */
+#define ATAIOC_COPY      (ATAIOC_BASE | 0x08) /* ata_copy_t */
+#define ATA_COPY_NBUF	4
+#define ATA_COPY_BUFSEC	256	/* sectors per buffer */
+
+typedef struct ata_copy {
+	u32_t	src_lba;	/* in: relative to the opened slice */
+	dev_t	dst_dev;	/* in: destination slice */
+	u32_t	dst_lba;	/* in: relative to the destination slice */
+	u32_t	nsec;		/* in */
+	u32_t	done;		/* out: sectors written */
+} ata_copy_t;
+
+/*
+ * ATAIOC_TRIM: not supported.  DATA SET MANAGEMENT is a DMA command
+ * and this driver is PIO-only, so the ioctl always fails with ENOTTY.
+ * The number stays reserved.
+ */
+#define ATAIOC_TRIM      (ATAIOC_BASE | 0x09) /* unsupported */
+
+#define ATA_AIO_FREE	0
+#define ATA_AIO_QUEUED	1
+#define ATA_AIO_DONE	2
+
+/*
+ * In-kernel block I/O (ata_kio_submit).  For driver-internal and
+ * module consumers: the transfer goes straight between the drive and
+ * the caller's kernel buffer with no struct buf.  lba is absolute on
+ * the unit.  done is called at interrupt level when the I/O finishes;
+ * with done NULL the caller waits in ata_kio_wait().  The ata_kio_t
+ * must stay put until then.
+ */
+#define ATA_KIO_WRITE	0x0001
+#define ATA_KIO_NOSLEEP	0x0002	/* submit from interrupt level */
+#define ATA_KIO_VERIFY	0x0004	/* READ VERIFY the range, addr unused */
+#define ATA_KIO_ZERO	0x0008	/* write zeros over the range, addr unused */
+#define ATA_KIO_DONE	0x0100	/* set by the driver on completion */
+#define ATA_KIO_MAXSEC	0x400000	/* sectors per kio: byte counts stay 32-bit */
+
+typedef struct ata_kio ata_kio_t;
+struct ata_kio {
+	int	unit;		/* ATA_UNIT_FROM(ctrl, drive) */
+	int	flags;		/* ATA_KIO_* */
+	ata_lba_t lba;
+	u32_t	nsec;
+	caddr_t	addr;		/* kernel buffer, nsec*512 bytes */
+	void	(*done)(ata_kio_t *);
+	void	*arg;		/* for the caller */
+	int	error;		/* out: 0 or errno */
+	u32_t	resid;		/* out: bytes not transferred */
+	ata_lba_t err_lba;	/* out: ATA_KIO_VERIFY: first bad sector */
+};
+
+typedef struct ata_aioslot {
+	int	state;		/* ATA_AIO_FREE/QUEUED/DONE */
+	int	is_write;
+	u32_t	tag;
+	caddr_t	ubuf;		/* caller's buffer */
+	caddr_t	kbuf;		/* staging copy */
+	u32_t	len;
+	struct buf *bp;
+	caddr_t	owner;		/* submitting process (UPROCP) ... */
+	dev_t	dev;		/* ... and minor: only they may reap it */
+} ata_aioslot_t;
+
+/* --- Capability flags (ata_caps_t.cflags) decoded from IDENTIFY --- */
+#define ACAP_LBA		0x00000001	/* LBA28 addressing */
+#define ACAP_LBA48		0x00000002	/* 48-bit feature set */
+#define ACAP_DMA		0x00000004	/* word 49 bit 8 */
+#define ACAP_MULTI_VALID	0x00000008	/* word 59 reports a setting */
+#define ACAP_WCACHE		0x00000010	/* write cache supported */
+#define ACAP_WCACHE_ON		0x00000020	/* write cache enabled */
+#define ACAP_LOOKAHEAD		0x00000040	/* look-ahead supported */
+#define ACAP_LOOKAHEAD_ON	0x00000080	/* look-ahead enabled */
+#define ACAP_FLUSH		0x00000100	/* FLUSH CACHE */
+#define ACAP_FLUSH_EXT		0x00000200	/* FLUSH CACHE EXT */
+#define ACAP_TRIM		0x00000400	/* never set: TRIM (DSM) needs DMA */
+#define ACAP_TRIM_DRAT		0x00000800	/* deterministic read after TRIM */
+#define ACAP_TRIM_RZAT		0x00001000	/* read zeros after TRIM */
+#define ACAP_LONG_LOGICAL	0x00002000	/* logical sector > 512 bytes */
+#define ACAP_ALIGN_VALID	0x00004000	/* word 209 valid */
+#define ACAP_QUEUED		0x00008000	/* queue depth reported */
+
 #define U_HAS_FLAG(u,f)	(((u)->flags & (f)) != 0)
 #define U_SET_FLAG(u,f)	((u)->flags |= (f))
 #define U_CLR_FLAG(u,f)	((u)->flags &= ~(f))
@@ -184,18 +398,45 @@ typedef enum {
 	SEL_LBA28
 } sel_state_t;
 
-/* Simple states for interrupt engine */
+/*
+ * Taskfile shadow: FEAT, SECTCNT and LBA0-2 (offsets 1..5) as last
+ * written, so ata_tf_out() can skip a register that already holds the
+ * byte.  Dropped (ata_tf_inval) whenever the device may have loaded
+ * its own values: reset, errors, IDENTIFY, ATAPI and any command
+ * other than a plain read/write on a tf_keep unit.
+ */
+#define ATA_TF_NREG	6
+
+/* Command engine states, see ata_sm[] in ide_ata.c */
 typedef enum {
 	AS_IDLE = 0,
-	AS_PRIMING,
-	AS_PRIMED,
-	AS_XFER,
-	AS_WAIT,
-	AS_DONE,
-	AS_RESET,
-	AS_ERROR
+	AS_ISSUE,		/* next chunk waits for !BSY && !DRQ */
+	AS_WAITDRQ,		/* write issued, first DRQ not up yet */
+	AS_XFER,		/* DRQ block expected */
+	AS_EOC,			/* command ends with an interrupt */
+	AS_DRAIN,		/* read data moved, drive not idle yet */
+	AS_PACKET,		/* ATAPI: atapi_service_irq() */
+	AS_NSTATE
 } ata_state_t;
 
+/* Where ata_sm_step() got its status byte */
+#define ATA_EV_IRQ	0	/* STATUS, in ataintr() */
+#define ATA_EV_POLL	1	/* ALTSTATUS, poll engine or a chase */
+#define ATA_EV_TICK	2	/* ALTSTATUS, ide_watchdog() */
+
+/* No progress for this long and ide_watchdog() fails the request */
+#define ATA_WD_STALL	(6*HZ)
+
+/* Per-channel probe engine states (ata_probe_ctrls) */
+typedef enum {
+	PS_IDLE = 0,
+	PS_RESET,		/* waiting for BSY to drop after SRST */
+	PS_SIG,			/* drive selected, reading signature */
+	PS_IDENT,		/* IDENTIFY issued, waiting for DRQ */
+	PS_SPINUP,		/* SET FEATURES spin-up issued */
+	PS_DONE
+} ata_probe_state_t;
+
 enum intr_trigger {
 	INTR_TRIGGER_INVALID 	= -1,
 	INTR_TRIGGER_CONFORM 	= 0,
@@ -236,16 +477,110 @@ typedef struct ata_last_cmd {
 	u8_t	cmd;
 	u8_t	sc;
 	u8_t	dh;
-	u32_t	lba;
+	ata_lba_t lba;
 	u8_t	err;
 	int	reqid;
 	u32_t	tick;
 } ata_last_cmd_t;
 
+/*
+ * Per-unit capability record, filled once by ata_identify() from the
+ * IDENTIFY DEVICE page and exported via ATAIOC_GETCAPS.  Everything the
+ * driver decides about command choice and chunk sizing comes from here.
+ */
+typedef struct ata_caps {
+	u32_t	cflags;		/* ACAP_* */
+	u16_t	max_multi;	/* word 47: max sectors per DRQ block */
+	u16_t	cur_multi;	/* word 59: current multiple setting */
+	u8_t	pio_modes;	/* word 64: bit0=PIO3, bit1=PIO4 */
+	u8_t	mwdma_modes;	/* word 63: supported MWDMA modes */
+	u8_t	udma_modes;	/* word 88: supported UDMA modes */
+	u8_t	udma_active;	/* word 88: selected UDMA mode */
+	u8_t	queue_depth;	/* word 75 + 1 */
+	u8_t	phys_shift;	/* log2(physical / logical) (word 106) */
+	u16_t	align_off;	/* word 209: LBA0 offset within physical */
+	u16_t	dsm_max;	/* word 105: max DSM payload blocks */
+	u16_t	ata_major;	/* word 80: supported ATA versions */
+	u32_t	log_secsz;	/* logical sector size in bytes */
+	u32_t	nsectors28;	/* words 60..61 */
+	u32_t	nsectors48_lo;	/* words 100..101 */
+	u32_t	nsectors48_hi;	/* words 102..103 */
+	u32_t	max_xfer;	/* sectors per command the driver will issue */
+} ata_caps_t;
+
+#define U_HAS_CAP(u,f)	(((u)->caps.cflags & (f)) != 0)
+
+/*
+ * 512e layout: logical sectors per physical sector, and where an
+ * absolute lba falls inside its physical sector (0 = on a boundary).
+ * Logical sector 0 sits align_off sectors into physical sector 0.
+ */
+#define ATA_PHYS_SECS(u)	(1UL << (u)->caps.phys_shift)
+#define ATA_PHYS_OFF(u,lba)	(((lba) + (u)->caps.align_off) & \
+				 (ATA_PHYS_SECS(u) - 1))
+
+/*
+ * Bounce buffer pool.  Allocated once by atainit() and shared by all
+ * channels: a channel binds a buffer when it starts work and hands it
+ * back when its queue drains.  Buffers are never freed.
+ */
+typedef struct ata_poolstat {
+	u32_t	nbuf;		/* buffers in the pool */
+	u32_t	bufsz;		/* bytes per buffer */
+	u32_t	inuse;		/* currently bound to a channel */
+	u32_t	hiwat;		/* most ever bound at once */
+	u32_t	binds;		/* successful binds */
+	u32_t	misses;		/* binds that found the pool empty */
+} ata_poolstat_t;
+
+typedef struct ata_bpool {
+	ata_poolstat_t st;
+	caddr_t	buf[ATA_BOUNCE_MAXBUF];
+	ata_ctrl_t *owner[ATA_BOUNCE_MAXBUF];
+} ata_bpool_t;
+
+/*
+ * GUID Partition Table, consulted when the MBR holds an EFI_PMBR
+ * entry.  Little-endian on disk, as is the host.
+ */
+#define GPT_HDR_LBA	1
+#define GPT_SIG_LO	0x20494645UL	/* "EFI " */
+#define GPT_SIG_HI	0x54524150UL	/* "PART" */
+#define GPT_HDR_MINSZ	92
+#define GPT_ENT_MINSZ	128
+#define GPT_MAXBYTES	(32*1024)	/* entry array we are willing to read */
+#define ATA_EBR_MAXHOP	32		/* bounds a looping EBR chain */
+
+typedef struct ata_gpt_hdr {
+	u32_t	sig[2];
+	u32_t	revision;
+	u32_t	hdr_size;
+	u32_t	hdr_crc;
+	u32_t	rsvd;
+	ata_lba_t my_lba;
+	ata_lba_t alt_lba;
+	ata_lba_t first_lba;	/* usable */
+	ata_lba_t last_lba;
+	u8_t	disk_guid[16];
+	ata_lba_t ent_lba;
+	u32_t	nent;
+	u32_t	ent_size;
+	u32_t	ent_crc;
+} ata_gpt_hdr_t;
+
+typedef struct ata_gpt_ent {
+	u8_t	type[16];	/* all zero: unused */
+	u8_t	uniq[16];
+	ata_lba_t first_lba;
+	ata_lba_t last_lba;	/* inclusive */
+	ata_lba_t attr;
+	u16_t	name[36];
+} ata_gpt_ent_t;
+
 typedef struct ata_part {
 	u8_t	active;
-	u32_t	base_lba;
-	u32_t	nsectors;
+	ata_lba_t base_lba;
+	u32_t	nsectors;	/* clamped to what a slice can address */
 	u8_t	systid;
 	int	vtoc_valid;
 	struct partition slice[ATA_NPART];
@@ -265,13 +600,26 @@ struct ata_ctrl {
 	/*** watchdog/timeout ***/
 	int	tmo_id;
 	int	tmo_ticks;
+	int	done_id;	/* ata_done_run() scheduled */
 
 	int	sel_drive;
 	u8_t	sel_hi4;
 	sel_state_t	sel_mode;
+
+	/*** taskfile shadow (ata_tf_out), indexed by register offset ***/
+	u8_t	tf_cur[ATA_TF_NREG];	/* last byte written */
+	u8_t	tf_hob[ATA_TF_NREG];	/* byte before that: LBA48 "previous" */
+	u8_t	tf_valid;		/* bit per register: tf_cur is on the wire */
+	u8_t	tf_hvalid;		/* ... tf_hob is too */
 	
 	u8_t	pio_multi;
-	int	multi_set_ok; /* 1 if SET MULTIPLE accepted */
+
+	/*** boot probe state (ata_probe_ctrls) ***/
+	ata_probe_state_t pstate;
+	int	pdrive;
+	long	pbudget;	/* usec left in current probe state */
+	int	psig_cmd;	/* IDENTIFY sent to force out signature */
+	int	pspinup;	/* spin-up already tried on pdrive */
 
 	ata_last_cmd_t	lc;
 
@@ -286,42 +634,44 @@ struct ata_ioque {
 	/*** Inflight request ***/
 	ata_req_t *cur;
 	ata_state_t state;
-	/*** IRQ Policy/close gating ***/
-	/*** sync/wakeup for raw/uio and close drain ***/
+	/*** Finished in the ISR, completed by ata_done_run() ***/
+	ata_req_t *d_head;
+	ata_req_t *d_tail;
+	/*** IRQ Policy ***/
 	
 	int last_err;
-	/*** staging buffer (lifetime: first open / last close ***/
-	/*caddr_t	xptr;*/
+	/*** ATAPI staging buffer, bound from ata_bpool while busy ***/
 	caddr_t xfer_buf;
 	u32_t	xfer_bufsz;
-	int	open_count;
+	int	open_count;	/* minors open on this channel */
 } ;
 
 /* Request representing a hardware chunk derived from a struct buf */
 struct ata_req {
 	struct ata_req *next;
 	struct buf   *bp;        /* original request */
+	ata_kio_t    *kio;       /* ... or in-kernel client, bp is NULL */
 
-	dev_t	dev;		/* Original dev, udriv could be deduced */
+	dev_t	dev;		/* Minor the request counts against (mio) */
 	int	drive;		/* Drive: 0 master 1 slave */
 	u32_t	reqid;
 
 	int	flags;
 	int 	is_write;  /* 1=write, 0=read */
-	int	await_drq_ticks;
 
 	/*** Chunking/progress ***/
 	caddr_t	addr;     	/* current kernel addr within bp */
-	u32_t	lba;       	/* device LBA(512B for ATA, 2048B for ATAPI) */
+	ata_lba_t lba;       	/* device LBA(512B for ATA, 2048B for ATAPI) */
 	u32_t	nsec;
-	u32_t	lba_cur;
+	ata_lba_t lba_cur;
 	u32_t	sectors_left;	/* How many sectors remain in entire request */
-	u16_t	chunk_left;	/* How many sectors remain in current burst */
+	u32_t	chunk_left;	/* How many sectors remain in current burst */
 	u32_t 	chunk_bytes;	/* How many bytes remain in current burst */
 	u32_t	xfer_off;
-	u16_t	prev_chunk_left;
-	u16_t	prev_sectors_left;
-	int	wdog_stuck;
+	ata_state_t prev_state;	/* ide_watchdog() progress check ... */
+	u32_t	prev_chunk_left;
+	u32_t	prev_sectors_left;
+	u32_t	wd_progress;	/* ... lbolt when it last saw some */
 	caddr_t	xptr;
 
 	u8_t	cmd;
@@ -336,17 +686,47 @@ struct ata_req {
 
 	u8_t	ast;
 	u8_t	err;
+
+	/*** set by ata_finish_current() for ata_done_req() ***/
+	u32_t	resid;
 };
 
 struct ata_unit {
 	u32_t	flags;
 
 	int 	lba_ok;              	/* 1 if LBA28 supported */
-	u32_t 	nsectors;  		/* total 512B sectors (ATA only) */
+	int	tf_keep;		/* taskfile survives completion (ata_tf_probe) */
+
+	/*** hybrid completion, see ata_hy_arm() ***/
+	u32_t	hy_avg;			/* recent command time, usec */
+	u32_t	hy_window;		/* usec the next command may spin */
+	u32_t	hy_skip;		/* commands issued without a spin */
+	u32_t	hy_spin;		/* completions caught spinning ... */
+	u32_t	hy_irq;			/* ... and left to the interrupt */
+	ata_lba_t nsectors;  		/* total 512B sectors (ATA only) */
 	int	pio_multi;
-
-	ata_part_t fd[4];
-	int	fdisk_valid;
+	int	multi_ok;		/* drive runs MULTIPLE at pio_multi */
+	ata_caps_t caps;		/* decoded IDENTIFY (ata_identify) */
+
+	ata_part_t fd[ATA_NFDISK];
+	int	fdisk_valid;		/* fd[] cached (ata_pdinfo) */
+	int	gpt_valid;		/* fd[] came from the GPT ... */
+	ata_lba_t gpt_first, gpt_last;	/* ... read from these sectors */
+	int	nebr;			/* EBRs the logical fd[] came from */
+	u32_t	ebr_lba[ATA_EBR_MAXHOP];
+
+	/*** per-minor open/close accounting, indexed by ATA_MINIDX ***/
+	u8_t	mopen[ATA_NMINIDX];	/* (1<<otyp) for each open type */
+	u16_t	mlyr[ATA_NMINIDX];	/* OTYP_LYR opens */
+	u16_t	mio[ATA_NMINIDX];	/* requests queued or in flight */
+	int	nopen;			/* minors open on this unit */
+
+	/*** async raw I/O, see ATAIOC_SUBMIT ***/
+	ata_aioslot_t aio[ATA_AIO_MAX];
+	u8_t	aio_ring[ATA_AIO_MAX];	/* finished slots, oldest first */
+	int	aio_rhead;
+	int	aio_rcnt;
+	int	aio_nout;		/* slots not free */
 
 	char 	model[41];
 	int  	ioctl_warned;
@@ -405,13 +785,17 @@ struct ata_counters
 	u32_t	lost_irq_rescued;
 	u32_t	wd_fired;
 	u32_t	wd_serviced;
-	u32_t	wd_rekicked;
 	u32_t	wd_arm;
 	u32_t	wd_cancel;
 	u32_t	wd_resets;
 	u32_t	wd_chunk;
-	u32_t	eoc_polled;
 	u32_t	softresets;
+	u32_t	xfer_direct;	/* chunks moved straight to/from the buf */
+	u32_t	wr_misaligned;	/* writes not on physical sector boundaries */
+	u32_t	tf_skipped;	/* taskfile writes the shadow made unnecessary */
+	u32_t	parked;		/* one tick watchdogs for polled states */
+	u32_t	early_start;	/* next request issued ahead of a completion */
+	u32_t	done_deferred;	/* completions left to ata_done_run() */
 } ;
 
 #include "ide_hw.h"
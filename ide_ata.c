@@ -12,6 +12,8 @@ ata_sel(ata_ctrl_t *ac, int drive, u32_t lba)
 
 		if (ac->sel_drive != drive || ac->sel_mode != SEL_LBA28 || 
 						   ac->sel_hi4 != hi4) {
+			/* the other device's registers may not match ours */
+			if (ac->sel_drive != drive) ata_tf_inval(ac);
 			ata_err(ac, &ast, &erc);
 			ATADEBUG(9,"ata_sel(%d,%lu) ST=%02x ER=%02x: ",
 				drive,lba,ast,erc);
@@ -25,6 +27,7 @@ ata_sel(ata_ctrl_t *ac, int drive, u32_t lba)
 	} else {
 		if (ac->sel_drive != drive || ac->sel_mode != SEL_CHS || 
 						   ac->sel_hi4 != 0) {
+			if (ac->sel_drive != drive) ata_tf_inval(ac);
 			ata_err(ac, &ast, &erc);
 			ATADEBUG(9,"ata_sel(%d,%lu) ST=%02x ER=%02x: ",
 				drive,lba,ast,erc);
@@ -48,35 +51,416 @@ ata_delay400(ata_ctrl_t *c)
 	(void)inb(ATA_ALTSTATUS_O(c));	/*Force delay*/
 }
 
+void
+ata_tf_inval(ata_ctrl_t *ac)
+{
+	ac->tf_valid  = 0;
+	ac->tf_hvalid = 0;
+}
+
 /*
- * Drain final command status after last PIO data transfer.
- * Some devices leave DRQ asserted briefly after the final data word.
- * We must not treat the request as complete until we observe !BSY && !DRQ
- * (or an error).
+ * Write one taskfile register unless the shadow says it holds v already.
+ */
+void
+ata_tf_out(ata_ctrl_t *ac, int reg, u8_t v)
+{
+	u8_t	bit = (u8_t)(1 << reg);
+
+	if (ata_tf_shadow && (ac->tf_valid & bit) && ac->tf_cur[reg] == v) {
+		BUMP(ac,tf_skipped);
+		return;
+	}
+	outb(ac->io_base + reg, v);
+	ac->tf_hob[reg] = ac->tf_cur[reg];
+	ac->tf_cur[reg] = v;
+	ac->tf_hvalid = (ac->tf_hvalid & ~bit) | (ac->tf_valid & bit);
+	ac->tf_valid |= bit;
+}
+
+/*
+ * LBA48 register pair.  Each register is a two deep FIFO and the
+ * device takes the older byte as the high half, so when the register
+ * already holds hob, writing lo alone puts both in place.
+ */
+void
+ata_tf_out48(ata_ctrl_t *ac, int reg, u8_t hob, u8_t lo)
+{
+	u8_t	bit = (u8_t)(1 << reg);
+
+	if (ata_tf_shadow && (ac->tf_hvalid & bit) &&
+	    ac->tf_hob[reg] == hob && ac->tf_cur[reg] == lo) {
+		BUMP(ac,tf_skipped);
+		BUMP(ac,tf_skipped);
+		return;
+	}
+	if (ata_tf_shadow && (ac->tf_valid & bit) && ac->tf_cur[reg] == hob)
+		BUMP(ac,tf_skipped);
+	else
+		outb(ac->io_base + reg, hob);
+	outb(ac->io_base + reg, lo);
+	ac->tf_hob[reg] = hob;
+	ac->tf_cur[reg] = lo;
+	ac->tf_valid  |= bit;
+	ac->tf_hvalid |= bit;
+}
+
+#define ATA_TF_PROBE_LBA	0x030201UL
+
+/*
+ * Find out whether the drive leaves SECTCNT and LBA0-2 alone when a
+ * data command completes cleanly.  ATA-3 and older drives load them
+ * with the address of the last sector moved; the shadow cannot be
+ * carried from one command to the next on those.
+ */
+void
+ata_tf_probe(ata_ctrl_t *ac, u8_t drive)
+{
+	ata_unit_t *u = ac->drive[drive];
+	u8_t	ast, err;
+
+	u->tf_keep = 0;
+	if (!u->lba_ok || u->nsectors <= ATA_TF_PROBE_LBA) return;
+
+	ata_sel(ac,drive,ATA_TF_PROBE_LBA);
+	outb(ATA_SECTCNT_O(ac), 1);
+	outb(ATA_LBA0_O(ac),    (u8_t)(ATA_TF_PROBE_LBA      ));
+	outb(ATA_LBA1_O(ac),    (u8_t)(ATA_TF_PROBE_LBA >>  8));
+	outb(ATA_LBA2_O(ac),    (u8_t)(ATA_TF_PROBE_LBA >> 16));
+	outb(ATA_CMD_O(ac), ATA_CMD_READ_VERIFY);
+	ata_delay400(ac);
+
+	if (ata_wait(ac, 0, ATA_SR_BSY, 1000000, &ast, &err) == 0 &&
+	    !(ast & (ATA_SR_ERR|ATA_SR_DWF)) &&
+	    inb(ATA_SECTCNT_O(ac)) == 1 &&
+	    inb(ATA_LBA0_O(ac)) == (u8_t)(ATA_TF_PROBE_LBA      ) &&
+	    inb(ATA_LBA1_O(ac)) == (u8_t)(ATA_TF_PROBE_LBA >>  8) &&
+	    inb(ATA_LBA2_O(ac)) == (u8_t)(ATA_TF_PROBE_LBA >> 16))
+		u->tf_keep = 1;
+
+	ata_tf_inval(ac);
+	ATADEBUG(1,"%s: drive %d taskfile %s on completion\n",
+		Cstr(ac), drive, u->tf_keep ? "kept" : "rewritten");
+}
+
+/*
+ * Command engine.  Every ATA request runs through the same table,
+ * whichever of ataintr() (STATUS, ATA_EV_IRQ), ide_poll_engine()
+ * (ALTSTATUS, ATA_EV_POLL) or ide_watchdog() (ALTSTATUS, ATA_EV_TICK)
+ * supplies the status byte:
+ *
+ *   ISSUE --> WAITDRQ (write) --+--> XFER <--+
+ *     ^       XFER    (read)  --+     |      | DRQ block
+ *     |       EOC     (verify)        +------+
+ *     |                               |
+ *     |      EOC (write/verify) <-----+ chunk moved
+ *     |      DRAIN (read)       <-----+
+ *     |        |
+ *     +--------+ sectors left, else complete
  *
- * Returns 0 on success, -1 on error/timeout.
+ * A state runs its action once the status shows the bits it waits
+ * for.  States no interrupt will announce (SM_POLLED) are chased for
+ * up to ATA_QUICK_US, then left to a one tick watchdog.  ATAPI
+ * requests sit in AS_PACKET and follow their own atapi_phase.
  */
-static int
-ata_drain_final_status(ata_ctrl_t *ac)
+#define SM_POLLED	0x01	/* no interrupt comes: chase, then tick */
+#define SM_IRQONLY	0x02	/* only an interrupt may run the action */
+#define SM_OWNERR	0x04	/* ERR/DWF is the action's business (ISSUE:
+				   stale, from the previous command) */
+
+typedef struct ata_sm_ent {
+	u8_t	set;		/* status bits the state waits for ... */
+	u8_t	clr;		/* ... and those that must be clear */
+	u8_t	flags;
+	void	(*act)(ata_ctrl_t *, ata_req_t *, u8_t);
+} ata_sm_ent_t;
+
+static void ata_sm_issue(ata_ctrl_t *, ata_req_t *, u8_t);
+static void ata_sm_block(ata_ctrl_t *, ata_req_t *, u8_t);
+static void ata_sm_eoc(ata_ctrl_t *, ata_req_t *, u8_t);
+static void ata_sm_packet(ata_ctrl_t *, ata_req_t *, u8_t);
+static int  ata_hy_arm(ata_ctrl_t *, ata_unit_t *, ata_req_t *);
+static int  ata_hy_spin(ata_ctrl_t *, ata_req_t *, u8_t *);
+
+static ata_sm_ent_t ata_sm[AS_NSTATE] = {
+/* AS_IDLE    */ { 0,	       0,			0,	 NULL },
+/* AS_ISSUE   */ { 0,	       ATA_SR_BSY|ATA_SR_DRQ,	SM_POLLED|SM_OWNERR, ata_sm_issue },
+/* AS_WAITDRQ */ { ATA_SR_DRQ, ATA_SR_BSY,		SM_POLLED, ata_sm_block },
+/* AS_XFER    */ { ATA_SR_DRQ, ATA_SR_BSY,		0,	 ata_sm_block },
+/* AS_EOC     */ { 0,	       ATA_SR_BSY|ATA_SR_DRQ,	0,	 ata_sm_eoc },
+/* AS_DRAIN   */ { 0,	       ATA_SR_BSY|ATA_SR_DRQ,	SM_POLLED, ata_sm_eoc },
+/* AS_PACKET  */ { 0,	       0,	SM_IRQONLY|SM_OWNERR,	 ata_sm_packet },
+};
+
+/*
+ * Port budget, interrupt mode, one drive streaming (selection and
+ * taskfile shadow warm):
+ *
+ *   per DRQ block 1 STATUS read in ataintr(), passed down as st
+ *		 256 data words a sector
+ *   per command 1 ALTSTATUS read in ata_program_taskfile()
+ *		 0-4 taskfile writes (0-8 LBA48) and the command
+ *		 writes: 4 ALTSTATUS reads of ata_delay400(), then
+ *		 1 or more chasing the first DRQ
+ *		 reads: 1 or more chasing AS_DRAIN
+ *   on error	 1 ERROR read
+ *   hybrid	 2 DEVCTRL writes, ALTSTATUS reads for the spin window
+ *		 and 1 STATUS read when it catches the drive
+ *
+ * Nothing else touches the ports, and no chase spins past
+ * ATA_QUICK_US; the hybrid spin stops at ata_hybrid_max_us.
+ */
+
+/*
+ * Feed one status sample to the current request and run actions for
+ * as long as their conditions hold.  Returns with the request waiting
+ * for its next event, or finished.
+ */
+void
+ata_sm_step(ata_ctrl_t *ac, ata_req_t *r, u8_t st, int ev)
 {
-	u8_t st;
-	int i;
+	ata_ioque_t *q = ac->ioque;
+	ata_sm_ent_t *e;
 
-	/* 400ns settle */
-	(void)inb(ATA_ALTSTATUS_O(ac));
+	while (q->cur == r) {
+		e = &ata_sm[q->state];
+		if (!e->act) return;
+
+		/* An interrupt is next, unless the hybrid spin wins */
+		if ((r->flags & ATA_RF_HYSPIN) && !(e->flags & SM_POLLED)) {
+			if (!ata_hy_spin(ac, r, &st))
+				return;
+			ev = ATA_EV_POLL;
+		}
+
+		if (!(e->flags & SM_OWNERR) && !(st & ATA_SR_BSY) &&
+		    (st & (ATA_SR_ERR|ATA_SR_DWF))) {
+			r->ast = st;
+			r->err = inb(ATA_ERROR_O(ac));
+			ata_finish_current(ac, EIO, __LINE__);
+			ide_kick(ac);
+			return;
+		}
+		if ((e->flags & SM_IRQONLY) && ev != ATA_EV_IRQ) return;
+		if ((st & e->set) != e->set || (st & e->clr)) return;
+
+		e->act(ac, r, st);
+
+		if (q->cur != r) return;
+		if (!(ata_sm[q->state].flags & SM_POLLED)) {
+			if (!(r->flags & ATA_RF_HYSPIN))
+				return;
+			continue;
+		}
+		e = &ata_sm[q->state];
+		(void)ata_wait(ac, e->set, e->clr, ATA_QUICK_US, &st, 0);
+		ev = ATA_EV_POLL;
+	}
+}
+
+/*
+ * A status sample for the current request: polled states get their
+ * usual ATA_QUICK_US chase.
+ */
+u8_t
+ata_sm_sample(ata_ctrl_t *ac)
+{
+	ata_sm_ent_t *e = &ata_sm[ac->ioque->state];
+	u8_t	st;
+
+	st = inb(ATA_ALTSTATUS_O(ac));
+	if ((e->flags & SM_POLLED) &&
+	    ((st & e->set) != e->set || (st & e->clr)))
+		(void)ata_wait(ac, e->set, e->clr, ATA_QUICK_US, &st, 0);
+	return st;
+}
+
+/*
+ * Step r, then whatever request its completion issued:
+ * ata_finish_current() only programs the next command and leaves it
+ * to the caller.  A loop rather than recursion, so a run of quick
+ * completions costs no stack, and at most ATA_SM_CHAIN of them per
+ * call; the rest wait for their interrupt or tick.
+ */
+void
+ata_sm_run(ata_ctrl_t *ac, ata_req_t *r, u8_t st, int ev)
+{
+	ata_ioque_t *q = ac->ioque;
+	int	n = 0;
+
+	while (r) {
+		ata_sm_step(ac, r, st, ev);
+		if (q->cur == r || ++n >= ATA_SM_CHAIN)
+			break;
+		if ((r = q->cur) != NULL)
+			st = ata_sm_sample(ac);
+		ev = ATA_EV_POLL;
+	}
+	ata_sm_arm(ac);
+}
+
+/*
+ * Re-arm the watchdog for whatever the current request now waits on:
+ * the next tick if no interrupt will tell us, else the usual HZ/8.
+ */
+void
+ata_sm_arm(ata_ctrl_t *ac)
+{
+	ata_ioque_t *q = ac->ioque;
 
-	for (i = 0; i < 1000; i++) {
-		st = inb(ATA_STATUS_O(ac));
+	if (!q || !q->cur) return;
+	if (!AC_HAS_FLAG(ac,ACF_INTR_MODE) || 
+	    (ata_sm[q->state].flags & SM_POLLED)) {
+		BUMP(ac,parked);
+		ide_arm_watchdog(ac,1);
+	} else {
+		ide_arm_watchdog(ac,HZ/8);
+	}
+}
 
-		if (st & (ATA_SR_ERR | ATA_SR_DWF))
-			return -1;
+/*
+ * Hybrid completion.  The first command of a request ide_start()
+ * issued for a caller that drives it next (ATA_RF_HYOK, never in the
+ * interrupt handler) gets INTRQ masked if its unit usually finishes
+ * within the spin window: twice its recent average, while that stays
+ * under ata_hybrid_max_us.  Slower units take the interrupt, with a
+ * spin at the full window every ATA_HY_PROBE commands to notice a
+ * change.
+ */
+static int
+ata_hy_arm(ata_ctrl_t *ac, ata_unit_t *u, ata_req_t *r)
+{
+	u32_t	w;
+	int	ok = (r->flags & ATA_RF_HYOK) && !AC_HAS_FLAG(ac,ACF_IN_ISR);
+
+	r->flags &= ~(ATA_RF_HYSPIN|ATA_RF_HYOK);
+	if (!AC_HAS_FLAG(ac,ACF_INTR_MODE))
+		return 0;
+	if (!ok || ata_hybrid_max_us <= 0) {
+		u->hy_irq++;
+		return 0;
+	}
 
-		if (!(st & ATA_SR_BSY) && !(st & ATA_SR_DRQ))
+	w = 2*u->hy_avg + ATA_HY_SLACK_US;
+	if (w > (u32_t)ata_hybrid_max_us) {
+		if (++u->hy_skip < ATA_HY_PROBE) {
+			u->hy_window = 0;
+			u->hy_irq++;
 			return 0;
+		}
+		w = (u32_t)ata_hybrid_max_us;
+	}
+	u->hy_skip   = 0;
+	u->hy_window = w;
+	r->flags |= ATA_RF_HYSPIN;
+	ATA_IRQ_OFF(ac,0);
+	return 1;
+}
 
-		drv_usecwait(1);
+/*
+ * The engine is about to wait for the interrupt of a command issued
+ * by ata_hy_arm(): spin on ALTSTATUS for the unit's window first.
+ * Either way INTRQ is unmasked again; a drive still busy raises it
+ * when done.  Returns 1 with the status in *st if the spin caught it.
+ */
+static int
+ata_hy_spin(ata_ctrl_t *ac, ata_req_t *r, u8_t *st)
+{
+	ata_unit_t *u = ac->drive[r->drive];
+	ata_sm_ent_t *e = &ata_sm[ac->ioque->state];
+	u32_t	t;
+	u8_t	s;
+
+	r->flags &= ~ATA_RF_HYSPIN;
+	for (t = 0; t < u->hy_window; t++) {
+		drv_usecwait(1);	/* also covers the 400ns before BSY */
+		s = inb(ATA_ALTSTATUS_O(ac));
+		if (s & ATA_SR_BSY) continue;
+		if (s & (ATA_SR_ERR|ATA_SR_DWF)) break;
+		if ((s & e->set) == e->set && !(s & e->clr)) break;
 	}
-	return -1;
+
+	if (t < u->hy_window) {
+		/* STATUS drops the interrupt the drive holds pending */
+		*st = inb(ATA_STATUS_O(ac));
+		ATA_IRQ_ON(ac);
+		u->hy_spin++;
+		u->hy_avg = (7*u->hy_avg + t) >> 3;
+		return 1;
+	}
+	ATA_IRQ_ON(ac);
+	u->hy_irq++;
+	u->hy_avg = (7*u->hy_avg + 2*(u32_t)ata_hybrid_max_us) >> 3;
+	return 0;
+}
+
+/* Drive idle: program the next chunk */
+static void
+ata_sm_issue(ata_ctrl_t *ac, ata_req_t *r, u8_t st)
+{
+	if (r->sectors_left > 0)
+		ata_request(ac, r, 0);
+	if (ac->ioque->state == AS_ISSUE) {
+		/* Nothing was issued: never spin in ISSUE */
+		ata_finish_current(ac, r->sectors_left ? EIO : EOK, __LINE__);
+		ide_kick(ac);
+	}
+}
+
+/*
+ * DRQ is up: move one DRQ block, a sector or a READ/WRITE MULTIPLE
+ * block, then wait for the next one or for the end of the command.
+ */
+static void
+ata_sm_block(ata_ctrl_t *ac, ata_req_t *r, u8_t st)
+{
+	ata_ioque_t *q = ac->ioque;
+	u32_t	n = ATA_CMD_IS_MULTI(r->cmd) ?
+			(u32_t)ac->drive[r->drive]->pio_multi : 1;
+
+	BUMP(ac,irq_drq_service);
+	if (n > r->chunk_left) n = r->chunk_left;
+	while (n--)
+		(void)pio_one_sector(ac, r);
+	r->lba_cur = r->lba + (r->xfer_off >> 9);
+
+	if (r->chunk_left > 0)
+		q->state = AS_XFER;
+	else
+		q->state = r->is_write ? AS_EOC : AS_DRAIN;
+}
+
+/*
+ * Command finished and the drive is idle: account for it, then issue
+ * the next chunk or complete the request.
+ */
+static void
+ata_sm_eoc(ata_ctrl_t *ac, ata_req_t *r, u8_t st)
+{
+	ata_ioque_t *q = ac->ioque;
+
+	BUMP(ac,irq_eoc);
+	if (r->flags & ATA_RF_NODATA) {
+		r->xfer_off	+= r->chunk_left << 9;
+		r->sectors_left	-= r->chunk_left;
+		r->chunk_left	 = 0;
+		r->lba_cur	 = r->lba + (r->xfer_off >> 9);
+	}
+
+	if (r->sectors_left == 0) {
+		/* ata_finish_current() copies out behind the next command */
+		ata_finish_current(ac, EOK, __LINE__);
+		ide_kick(ac);
+		return;
+	}
+
+	q->state = AS_ISSUE;
+	ata_sm_issue(ac, r, st);
+}
+
+static void
+ata_sm_packet(ata_ctrl_t *ac, ata_req_t *r, u8_t st)
+{
+	atapi_service_irq(ac, r, st);
 }
 
 
@@ -109,12 +493,34 @@ ata_wait(ata_ctrl_t *ac, u8_t must_set, u8_t must_clear, long usec, u8_t *st, u8
 }
 
 
+/*
+ * Register write-back test on the selected device.  An empty position
+ * (or floating bus) does not latch SECTCNT/SECTNUM, so this tells within
+ * a few port cycles whether anything is there at all.  Only meaningful
+ * while BSY is clear.  Returns 1 if the registers hold their values.
+ */
+int
+ata_regs_respond(ata_ctrl_t *ac)
+{
+	ata_tf_inval(ac);
+	outb(ATA_SECTCNT_O(ac), 0x55);
+	outb(ATA_SECTNUM_O(ac), 0xAA);
+	if (inb(ATA_SECTCNT_O(ac)) != 0x55 || inb(ATA_SECTNUM_O(ac)) != 0xAA)
+		return 0;
+	outb(ATA_SECTCNT_O(ac), 0xAA);
+	outb(ATA_SECTNUM_O(ac), 0x55);
+	if (inb(ATA_SECTCNT_O(ac)) != 0xAA || inb(ATA_SECTNUM_O(ac)) != 0x55)
+		return 0;
+	return 1;
+}
+
 int
 ata_identify(ata_ctrl_t *ac, int drive)
 {
 	ata_unit_t *u=ac->drive[drive];
 	ata_req_t rb, *r=&rb;
 	u16_t 	id[256];
+	u8_t	st;
 	int 	i;
 
 	ATADEBUG(1,"ata_identify(%s): io=%x\n",Cstr(ac),ac->io_base);
@@ -123,7 +529,16 @@ ata_identify(ata_ctrl_t *ac, int drive)
 
 	ATA_IRQ_OFF(ac,1);
 
-	bzero((caddr_t)r,sizeof(r));
+	/* Empty position: don't sit in the BSY/DRQ timeouts below */
+	ata_sel(ac, drive, 0);
+	st = inb(ATA_ALTSTATUS_O(ac));
+	if (ATA_ST_FLOATING(st) || 
+	    (!(st & ATA_SR_BSY) && !ata_regs_respond(ac))) {
+		U_CLR_FLAG(u,UF_PRESENT);
+		return ENODEV;
+	}
+
+	bzero((caddr_t)r,sizeof(*r));
 	r->drive	= drive;
 	r->cmd		= (u->devtype & DEV_ATAPI) ? ATA_CMD_IDENTIFY_PKT 
 						   : ATA_CMD_IDENTIFY;
@@ -133,23 +548,153 @@ ata_identify(ata_ctrl_t *ac, int drive)
 	r->is_write	= 0;
 	ata_program_taskfile(ac,r);
 
-	if (ata_wait(ac, ATA_SR_DRQ, ATA_SR_BSY, 500000, 0, 0) != 0) {
+	/* Wait for BSY only; an aborted IDENTIFY shows ERR without DRQ */
+	if (ata_wait(ac, 0, ATA_SR_BSY, 500000, &st, 0) != 0 ||
+	    (st & (ATA_SR_ERR|ATA_SR_DWF)) || !(st & ATA_SR_DRQ)) {
 		/* no ATA device mark not present */
 		U_CLR_FLAG(u,UF_PRESENT);
 		return ENODEV;
 	}
 
 	insw(ATA_DATA_O(ac),id,256);
+	ata_identify_done(ac,drive,id);
+	return 0;
+}
+
+/*
+ * Record a freshly read IDENTIFY page for the unit.  Shared by
+ * ata_identify() and the boot probe engine.
+ */
+void
+ata_identify_done(ata_ctrl_t *ac, int drive, u16_t *id)
+{
+	ata_unit_t *u=ac->drive[drive];
 
 	/* Extract model string (word-swapped ASCII) */
 	strcpy(u->model,getstr(&((char *)id)[54],40,TRUE,TRUE,TRUE));
 
-	/* LBA28 capacity in words 60 61 */
-	u->nsectors = ((u32_t)id[61] << 16) | (u32_t)id[60];
-	u->lba_ok   = (id[49] & (1<<9)) ? 1 : 0;
+	ata_parse_identify(u,id);
+
+	u->nsectors = u->caps.nsectors28;
+	if (U_HAS_CAP(u,ACAP_LBA48)) {
+		ata_lba_t n48 = ((ata_lba_t)u->caps.nsectors48_hi << 32) |
+				u->caps.nsectors48_lo;
+		if (n48 > u->nsectors)
+			u->nsectors = n48;
+	}
+	u->lba_ok   = U_HAS_CAP(u,ACAP_LBA) ? 1 : 0;
 	U_SET_FLAG(u,UF_PRESENT);
 	u->read_only = 0;
-	return 0;
+}
+
+/*
+ * Decode the IDENTIFY DEVICE page into u->caps.  Words that carry a
+ * validity signature (bit 15 clear, bit 14 set) are ignored when it is
+ * missing, which is the case on older drives for 106/209 etc.
+ */
+void
+ata_parse_identify(ata_unit_t *u, u16_t *id)
+{
+	ata_caps_t *cp = &u->caps;
+	u16_t	w;
+	int	i;
+
+	bzero((caddr_t)cp,sizeof(*cp));
+
+	cp->max_multi = id[ATA_ID_MAX_MULTI] & 0xff;
+	w = id[ATA_ID_CUR_MULTI];
+	if (w & 0x0100) {
+		cp->cflags   |= ACAP_MULTI_VALID;
+		cp->cur_multi = w & 0xff;
+	}
+
+	if (id[ATA_ID_CAPS] & (1<<9)) cp->cflags |= ACAP_LBA;
+	if (id[ATA_ID_CAPS] & (1<<8)) cp->cflags |= ACAP_DMA;
+
+	cp->mwdma_modes = (u8_t)(id[ATA_ID_MWDMA] & 0x07);
+	if (id[ATA_ID_FIELD_VALID] & 0x02)
+		cp->pio_modes = (u8_t)(id[ATA_ID_PIO_MODES] & 0x03);
+	if (id[ATA_ID_FIELD_VALID] & 0x04) {
+		w = id[ATA_ID_UDMA];
+		cp->udma_modes = (u8_t)(w & 0x7f);
+		for (i = 6; i >= 0; i--) {
+			if (w & (0x100 << i)) {
+				cp->udma_active = (u8_t)(i + 1); /* 0=none */
+				break;
+			}
+		}
+	}
+
+	w = id[ATA_ID_MAJOR];
+	cp->ata_major = (w == 0xffff) ? 0 : w;
+
+	cp->nsectors28 = ((u32_t)id[ATA_ID_LBA28_HI] << 16) | 
+			  (u32_t)id[ATA_ID_LBA28_LO];
+
+	if (ATA_ID_WORD_VALID(id[ATA_ID_CMDSET2])) {
+		if (id[ATA_ID_CMDSET1] & (1<<5)) cp->cflags |= ACAP_WCACHE;
+		if (id[ATA_ID_CMDSET1] & (1<<6)) cp->cflags |= ACAP_LOOKAHEAD;
+		if (id[ATA_ID_CMDSET1_EN] & (1<<5)) cp->cflags |= ACAP_WCACHE_ON;
+		if (id[ATA_ID_CMDSET1_EN] & (1<<6)) cp->cflags |= ACAP_LOOKAHEAD_ON;
+		if (id[ATA_ID_CMDSET2] & (1<<12)) cp->cflags |= ACAP_FLUSH;
+		if (id[ATA_ID_CMDSET2] & (1<<13)) cp->cflags |= ACAP_FLUSH_EXT;
+		if (id[ATA_ID_CMDSET2] & (1<<1)) {
+			cp->cflags |= ACAP_QUEUED;
+			cp->queue_depth = (u8_t)((id[ATA_ID_QUEUE_DEPTH] & 0x1f)+1);
+		}
+		if ((id[ATA_ID_CMDSET2] & (1<<10)) &&
+		    (id[ATA_ID_CMDSET2_EN] & (1<<10))) {
+			cp->cflags |= ACAP_LBA48;
+			cp->nsectors48_lo = ((u32_t)id[ATA_ID_LBA48+1] << 16) |
+					     (u32_t)id[ATA_ID_LBA48+0];
+			cp->nsectors48_hi = ((u32_t)id[ATA_ID_LBA48+3] << 16) |
+					     (u32_t)id[ATA_ID_LBA48+2];
+		}
+	}
+	if (cp->queue_depth == 0) cp->queue_depth = 1;
+
+	/* Logical / physical sector layout */
+	cp->log_secsz = ATA_SECSIZE;
+	w = id[ATA_ID_SECTOR_SIZE];
+	if (ATA_ID_WORD_VALID(w)) {
+		if (w & (1<<13))
+			cp->phys_shift = (u8_t)(w & 0x0f);
+		if (w & (1<<12)) {
+			u32_t words = ((u32_t)id[ATA_ID_LOG_SECSZ+1] << 16) |
+				       (u32_t)id[ATA_ID_LOG_SECSZ];
+			if (words >= (ATA_SECSIZE/2)) {
+				cp->cflags   |= ACAP_LONG_LOGICAL;
+				cp->log_secsz = words << 1;
+			}
+		}
+	}
+	w = id[ATA_ID_ALIGNMENT];
+	if (ATA_ID_WORD_VALID(w)) {
+		cp->cflags   |= ACAP_ALIGN_VALID;
+		cp->align_off = w & 0x3fff;
+	}
+
+	/*
+	 * DATA SET MANAGEMENT / TRIM, reported for ATAIOC_GETCAPS only.
+	 * DSM is a DMA-protocol command and this driver only does PIO,
+	 * so ACAP_TRIM is never set and TRIM is never issued.
+	 */
+	if (id[ATA_ID_DSM] & 0x0001) {
+		cp->dsm_max = id[ATA_ID_DSM_MAX];
+		if (id[ATA_ID_ADD_SUPPORTED] & (1<<14)) 
+			cp->cflags |= ACAP_TRIM_DRAT;
+		if (id[ATA_ID_ADD_SUPPORTED] & (1<<5))  
+			cp->cflags |= ACAP_TRIM_RZAT;
+	}
+
+	/* Per-command sector limit: 8-bit count for LBA28, 16-bit for LBA48 */
+	cp->max_xfer = (cp->cflags & ACAP_LBA48) ? ATA_MAX_XFER_SECTORS_EXT
+						 : ATA_MAX_XFER_SECTORS;
+
+	ATADEBUG(1,"ata_parse_identify: cflags=%08lx multi=%d/%d pio=%x udma=%x/%d qd=%d phys_shift=%d align=%d max_xfer=%lu\n",
+		cp->cflags, cp->max_multi, cp->cur_multi, cp->pio_modes,
+		cp->udma_modes, cp->udma_active, cp->queue_depth,
+		cp->phys_shift, cp->align_off, cp->max_xfer);
 }
 
 int
@@ -228,19 +773,39 @@ ata_dump_stats(void)
 			ac->counters->irq_no_cur,
 			ac->counters->irq_bsy_skipped,
 			ac->counters->irq_drq_service);
- 		printf("      eoc=%lu eoc_polled=%lu lost_irq_rescued=%lu softresets=%lu\n",
+ 		printf("      eoc=%lu early=%lu deferred=%lu lost_irq_rescued=%lu softresets=%lu\n",
 			ac->counters->irq_eoc, 
-			ac->counters->eoc_polled,
+			ac->counters->early_start,
+			ac->counters->done_deferred,
 			ac->counters->lost_irq_rescued,
 			ac->counters->softresets);
- 		printf("      WD: arm=%lu cancel=%lu fired=%lu service=%lu rekicked=%lu chunk=%ld\n",
+ 		printf("      WD: arm=%lu cancel=%lu fired=%lu service=%lu chunk=%ld parked=%lu\n",
 			ac->counters->wd_arm,
 			ac->counters->wd_cancel,
 			ac->counters->wd_fired,
 			ac->counters->wd_serviced, 
-			ac->counters->wd_rekicked,
-			ac->counters->wd_chunk);
+			ac->counters->wd_chunk,
+			ac->counters->parked);
+ 		printf("      XFER: direct=%lu misaligned=%lu\n",
+			ac->counters->xfer_direct,
+			ac->counters->wr_misaligned);
+ 		printf("      TF: skipped=%lu\n",
+			ac->counters->tf_skipped);
+		for (driv = 0; driv < ATA_MAX_DRIVES; driv++) {
+			ata_unit_t *u = ac->drive[driv];
+
+			if (!u || !U_HAS_FLAG(u,UF_PRESENT) ||
+			    U_HAS_FLAG(u,UF_ATAPI))
+				continue;
+			printf("      D%d HYBRID: window=%luus avg=%luus spin=%lu irq=%lu\n",
+				driv, u->hy_window, u->hy_avg,
+				u->hy_spin, u->hy_irq);
+		}
 	}
+	printf("BOUNCE: nbuf=%lu bufsz=%lu inuse=%lu hiwat=%lu binds=%lu misses=%lu\n",
+		ata_bpool.st.nbuf, ata_bpool.st.bufsz,
+		ata_bpool.st.inuse, ata_bpool.st.hiwat,
+		ata_bpool.st.binds, ata_bpool.st.misses);
 }
 
 void
@@ -256,6 +821,10 @@ ata_softreset_ctrl(ata_ctrl_t *ac)
 	outb(ATA_DEVCTRL_O(ac), ATA_CTL_NIEN); /* deassert SRST */
 	(void)inb(ATA_ALTSTATUS_O(ac));
 
+	/* Reset loads the signature and DRIVE/HEAD: nothing cached holds */
+	ata_tf_inval(ac);
+	ac->sel_hi4 = 0xff;	/* forces the next ata_sel() out */
+
 	if (was_enabled) ATA_IRQ_ON(ac);
 }
 
@@ -267,6 +836,7 @@ ata_enable_pio_multiple(ata_ctrl_t *ac, u8_t drive, u8_t multi)
 	if (!multi || multi <= 1) return 0;
 
 	ata_sel(ac,drive,0);
+	ata_tf_inval(ac);
 
 	outb(ATA_SECTCNT_O(ac),multi);
 	outb(ATA_CMD_O(ac),ATA_CMD_SET_MULTI);
@@ -278,7 +848,11 @@ ata_enable_pio_multiple(ata_ctrl_t *ac, u8_t drive, u8_t multi)
 	return 0;
 }
 
-/* Negotiate a valid multi-sector count: try 16/8/4/2 (or 8/4/2) based on policy. */
+/*
+ * Set the multi-sector count from IDENTIFY word 47 (capped by policy to
+ * 16 or 8) instead of probing 16/8/4/2 with a 1s wait each.  When word
+ * 59 already reports that setting no command is issued at all.
+ */
 void
 ata_negotiate_pio_multiple(ata_ctrl_t *ac, u8_t drive)
 {
@@ -288,24 +862,36 @@ ata_negotiate_pio_multiple(ata_ctrl_t *ac, u8_t drive)
 
     /*
      * IMPORTANT:
-     *  - POLL mode chunking uses per-unit u->pio_multi (see ata_request()).
-     *  - Some other paths consult ac->pio_multi.
-     *
-     * So, when SET MULTIPLE MODE succeeds we must update BOTH.
+     *  - Chunking, multicmd() and the DRQ block size in ata_sm_block()
+     *    all use the per-unit u->pio_multi: master and slave may differ.
+     *  - ac->pio_multi only records the unit probed last.
      */
     u = (ac && drive < 2) ? ac->drive[drive] : NULL;
-    if (target > 16) target = 16;
-    if (target < 2)  target = 2;
+    if (!u) return;
 
-    for (n = target; n >= 2; n >>= 1) {
+    /* Largest power of two the drive supports, within policy */
+    for (n = target; n >= 2; n >>= 1)
+	if (n <= u->caps.max_multi) break;
+
+    if (n >= 2) {
+	if (U_HAS_CAP(u,ACAP_MULTI_VALID) && u->caps.cur_multi == n) {
+            u->pio_multi = n;
+            ac->pio_multi = n;
+	    u->multi_ok = 1;
+            return;
+	}
 	if (ata_enable_pio_multiple(ac,drive,n) == 0) {
-            if (u) u->pio_multi = n;
+            u->pio_multi = n;
             ac->pio_multi = n;
+	    u->caps.cur_multi = n;
+	    u->caps.cflags |= ACAP_MULTI_VALID;
+	    u->multi_ok = 1;
             return;
         }
     }
-    if (u) u->pio_multi = 1;
+    u->pio_multi = 1;
     ac->pio_multi = 1;
+    u->multi_ok = 0;
     ATADEBUG(1, "%s: PIO multiple not supported, using single-sector\n",
 		Cstr(ac));
 }
@@ -388,7 +974,8 @@ pio_one_sector(ata_ctrl_t *ac, ata_req_t *r)
 		for(i=0; i<(ATA_SECSIZE/2); i++)
 			p16[i] = inw(ATA_DATA_O(ac));
 	}
-	r->xptr     += ATA_SECSIZE;
+	if (!(r->flags & ATA_RF_ZEROSRC))
+		r->xptr += ATA_SECSIZE;
 	r->xfer_off += ATA_SECSIZE;
 	if (r->chunk_left >= 0)   r->chunk_left--;
 	if (r->sectors_left >= 0) r->sectors_left--;
@@ -396,122 +983,21 @@ pio_one_sector(ata_ctrl_t *ac, ata_req_t *r)
 	return 0;
 }
 
-void
-ata_service_irq(ata_ctrl_t *ac, ata_req_t *r, u8_t st)
-{
-	ata_ioque_t *q = ac ? ac->ioque : 0;
-	int	i;
-	u8_t ast, err;
-
-	if (!r) {
-		BUMP(ac, irq_no_cur);
-		return;
-	}
-
-	ata_err(ac,&ast,&err);
-	/*printf("ata_service_irq: ST=%02x ER=%02x DRQ=%d BSY=%d reqid=%d lba=%ld flags=%x\n",
-		ast,err,!!(ast&ATA_SR_DRQ),!!(ast&ATA_SR_BSY),
-		r->reqid,r->lba_cur,ac->flags);		*/
-
-	/* ---- (1) Error Handling ---- */
-	if (st & (ATA_SR_ERR | ATA_SR_DWF)) {
-		u8_t er = inb(ATA_ERROR_O(ac));
-		r->ast = st;
-		r->err = er;
-		ata_finish_current(ac,EIO,__LINE__); 
-		ide_kick(ac); /*NEW*/
-		return;
-	}
-
-	/* ---- (2) Data phase: DRQ asserted transfer one sector ---- */
-	if (st & ATA_SR_DRQ) {
-		if (ata_data_phase_service(ac,r) < 0) {
-			ata_finish_current(ac, EIO, __LINE__);
-			ide_kick(ac); /*NEW*/
-			return;
-		}
-		if (r->chunk_left) return;
-
-		if (!r->is_write && (r->flags & ATA_RF_NEEDCOPY) &&
-		    q->xfer_buf && r->chunk_bytes) {
-			caddr_t dst = (caddr_t)((u8_t *)r->addr + (r->xfer_off - r->chunk_bytes));
-			if (valid_usr_range((addr_t)dst, r->chunk_bytes)) {
-				bcopy((caddr_t)q->xfer_buf,dst,(size_t)(r->chunk_bytes));
-			} else {
-				r->err = EFAULT;
-			}
-			r->flags &= ~ATA_RF_NEEDCOPY;
-		}
-		
-		/* No more sectors? we're done */
-		if (r->sectors_left == 0) {
-			if (!r->is_write) {
-				/* READ completes at last data phase; ensure DRQ/BSY have dropped */
-				if (ata_drain_final_status(ac) < 0) {
-					ata_finish_current(ac, EIO, __LINE__);
-					ide_kick(ac); /*NEW*/
-				} else {
-					ata_finish_current(ac, EOK, __LINE__);
-					ide_kick(ac); /*NEW*/
-				}
-			}
-			/* 
-			 * For writes do not finish here; we expect a 
-			 * final completion interrupt once the device is
-			 * fully idle (BSY=0, DRQ=0). That inteerupt will
-			 * be handled in the "final completion" branch below
-			 */
-			return;
-		}
-
-		/* Otherwise: if we're still in the current ATA command (chunk_left > 0),
-		 * do NOT issue a new command. Just wait for the next DRQ edge.
-		 * When chunk_left reaches 0, the current command should be complete; drain
-		 * final status, then either start the next chunk or finish the request.
-		 */
-		if (r->chunk_left > 0) {
-			return;
-		}
-		{
-			u8_t st2 = 0, er2 = 0;
-			/* ensure command completion before issuing a new one */
-			(void)ata_wait(ac, 0, ATA_SR_BSY|ATA_SR_DRQ, 200000, &st2, &er2);
-		}
-		/* Start next chunk (new command) for remaining sectors */
-		ata_program_next_chunk(ac, r, HZ/8);
-		return;
-	}	
-
-	/* ---- (3) Final completion drive idle, no error ---- */
-	if (!(st & ATA_SR_BSY) &&
-	    !(st & ATA_SR_DRQ)) {
-		if (r->sectors_left == 0) {
-			ATADEBUG(2,"Calling finish as !ATA_SR_BSY && !ATA_SR_DRQ ST=%02x flags=%08x\n",st,ac->flags);
-			ata_finish_current(ac, EOK, __LINE__);
-			ATADEBUG(2,"Now calling ide_kick flags=%08x\n",
-				ac->flags);
-			ide_kick(ac); /*NEW*/
-			return;
-		}
-	}
-
-	ide_arm_watchdog(ac,HZ/8);
-}
-
 void
 ata_program_taskfile(ata_ctrl_t *ac, ata_req_t *r)
 {
-	u32_t lba    = r->lba_cur;
+	ata_lba_t lba = r->lba_cur;
 	u8_t  drive  = (r->drive & 0x1);
 	u8_t  cmd    = r->cmd;
 	u16_t todo   = (r->nsec == 0) ? 256 : ((r->nsec>256) ? 256 : r->nsec);
 	u8_t  sc     = (todo == 256) ? 0 : todo;
-	u8_t 	ast, err, dh;
-	int	er;
+	u16_t sc16   = (r->nsec >= ATA_MAX_XFER_SECTORS_EXT) ? 0 : (u16_t)r->nsec;
+	u8_t 	ast, err;
 
-	ata_wait(ac,0,ATA_SR_BSY,500000,0,0);
-	ata_sel(ac, drive, lba);
-	er=ata_err(ac,&ast,&err);
+	/* The previous command must be off the bus: BSY and DRQ clear */
+	ata_wait(ac,0,ATA_SR_BSY|ATA_SR_DRQ,500000,&ast,&err);
+	ata_sel(ac, drive, ATA_CMD_IS_EXT(cmd) ? 0 : ATA_LBA_LO(lba));
+	if (!ac->drive[drive]->tf_keep) ata_tf_inval(ac);
 	r->flags &= ~ATA_RF_CDB_SENT;
 
 	/* Cache last command */
@@ -525,22 +1011,28 @@ ata_program_taskfile(ata_ctrl_t *ac, ata_req_t *r)
 
 	switch (cmd) {
 	case ATA_CMD_READ_SEC:
-	case ATA_CMD_READ_SEC_EXT:
 	case ATA_CMD_READ_MULTI:
-		outb(ATA_SECTCNT_O(ac), sc);
-		outb(ATA_LBA0_O(ac),    (u8_t)(lba      ));
-		outb(ATA_LBA1_O(ac),    (u8_t)(lba >>  8));
-		outb(ATA_LBA2_O(ac),    (u8_t)(lba >> 16));
+	case ATA_CMD_READ_VERIFY:
+	case ATA_CMD_WRITE_SEC:
+	case ATA_CMD_WRITE_MULTI:
+		/* Through the shadow: sequential I/O rarely moves LBA1/LBA2 */
+		ata_tf_out(ac, ATA_SECTCNT, sc);
+		ata_tf_out(ac, ATA_LBA0,    (u8_t)(lba      ));
+		ata_tf_out(ac, ATA_LBA1,    (u8_t)(lba >>  8));
+		ata_tf_out(ac, ATA_LBA2,    (u8_t)(lba >> 16));
 		outb(ATA_CMD_O(ac), cmd);
 		break;
 
-	case ATA_CMD_WRITE_SEC:
+	case ATA_CMD_READ_SEC_EXT:
+	case ATA_CMD_READ_MULTI_EXT:
+	case ATA_CMD_READ_VERIFY_EXT:
 	case ATA_CMD_WRITE_SEC_EXT:
-	case ATA_CMD_WRITE_MULTI:
-		outb(ATA_SECTCNT_O(ac), sc);
-		outb(ATA_LBA0_O(ac),    (u8_t)(lba      ));
-		outb(ATA_LBA1_O(ac),    (u8_t)(lba >>  8));
-		outb(ATA_LBA2_O(ac),    (u8_t)(lba >> 16));
+	case ATA_CMD_WRITE_MULTI_EXT:
+		/* 48-bit: "previous" (HOB) byte, then current, per register */
+		ata_tf_out48(ac, ATA_SECTCNT, (u8_t)(sc16 >> 8), (u8_t)(sc16));
+		ata_tf_out48(ac, ATA_LBA0, (u8_t)(lba >> 24), (u8_t)(lba      ));
+		ata_tf_out48(ac, ATA_LBA1, (u8_t)(lba >> 32), (u8_t)(lba >>  8));
+		ata_tf_out48(ac, ATA_LBA2, (u8_t)(lba >> 40), (u8_t)(lba >> 16));
 		outb(ATA_CMD_O(ac), cmd);
 		break;
 
@@ -563,6 +1055,7 @@ ata_program_taskfile(ata_ctrl_t *ac, ata_req_t *r)
 		break;
 
 	case ATA_CMD_FLUSH_CACHE:
+	case ATA_CMD_FLUSH_CACHE_EXT:
 		outb(ATA_CMD_O(ac), cmd);
 		break;
 
@@ -575,19 +1068,16 @@ ata_program_taskfile(ata_ctrl_t *ac, ata_req_t *r)
 		break;
 	}
 
-	ata_delay400(ac); 
-	if (AC_HAS_FLAG(ac,ACF_INTR_MODE)) {
-		drv_usecwait(20);
-		if (cmd == ATA_CMD_WRITE_SEC ||
-		    cmd == ATA_CMD_WRITE_SEC_EXT ||
-		    cmd == ATA_CMD_WRITE_MULTI) {
-			if (ata_wait(ac,ATA_SR_DRQ,ATA_SR_BSY,200000,0,0) == 0)
-				ata_prime_write(ac,r);
-			else
-				ATADEBUG(2,"%s: DRQ not ready for write ST=%02x\n",
-					Cstr(ac),inb(ATA_ALTSTATUS_O(ac)));
-		}
-	}
+	/* Anything but a plain read/write may hand back its own values */
+	if (!ATA_CMD_IS_RW(cmd)) ata_tf_inval(ac);
+
+	/*
+	 * Interrupt-mode reads do not look at status again until the
+	 * interrupt, so they skip the 400ns settle; writes (AS_WAITDRQ
+	 * is chased) and the poll engine read it next and need it.
+	 */
+	if (!AC_HAS_FLAG(ac,ACF_INTR_MODE) || ATA_CMD_IS_WRITE(cmd))
+		ata_delay400(ac);
 }
 
 int 
@@ -600,6 +1090,36 @@ ata_program_next_chunk(ata_ctrl_t *ac, ata_req_t *r,int arm_ticks)
 		return ata_request(ac,r,arm_ticks);
 }
 
+/*
+ * Sectors in the next interrupt-mode command: bounded by what the
+ * unit takes in one command.
+ */
+u32_t
+ata_intr_chunk(ata_ctrl_t *ac, ata_unit_t *u, u32_t left)
+{
+	u32_t	maxcmd = u->caps.max_xfer ? u->caps.max_xfer
+				      : ATA_MAX_XFER_SECTORS;
+
+	return (left > maxcmd) ? maxcmd : left;
+}
+
+/*
+ * On a drive with physical sectors larger than 512 bytes, shorten a
+ * write chunk of n sectors at absolute lba that is not the last one
+ * (left sectors remain) so it ends on a physical boundary: the next
+ * chunk then starts aligned and the drive does not read-modify-write
+ * at the seam.  A chunk smaller than the misalignment is left alone.
+ */
+u32_t
+ata_align_chunk(ata_unit_t *u, ata_lba_t lba, u32_t n, u32_t left)
+{
+	u32_t	tail;
+
+	if (u->caps.phys_shift == 0 || n >= left) return n;
+	tail = ATA_PHYS_OFF(u, lba + n);
+	return (tail < n) ? n - tail : n;
+}
+
 int 
 ata_request(ata_ctrl_t *ac,ata_req_t *r,int arm_ticks)
 {
@@ -609,20 +1129,18 @@ ata_request(ata_ctrl_t *ac,ata_req_t *r,int arm_ticks)
 	ata_unit_t  *u = ac->drive[r->drive];
 	u8_t	ast;
 	int	s, er, multi_ok;
-	caddr_t	user_ptr;
 
 	ATADEBUG(2,"ata_request(Reqid=%ld)\n",r ? r->reqid : 0);
 	if (!r) return;
 
-	if (AC_HAS_FLAG(ac,ACF_INTR_MODE)) {
-		n = (r->sectors_left > 256U) ? 256U : r->sectors_left;
+	if (r->flags & ATA_RF_NODATA) {
+		/* READ VERIFY: the drive does the work, go large */
+		n = ata_intr_chunk(ac, u, r->sectors_left);
+		if (n > ATA_VERIFY_CHUNK) n = ATA_VERIFY_CHUNK;
+		if (n == 0) return;
+	} else if (AC_HAS_FLAG(ac,ACF_INTR_MODE)) {
+		n = ata_intr_chunk(ac, u, r->sectors_left);
 		if (n == 0) return;
-
-		/* Cap sectors to bounce-buffer capacity in interrupt mode */
-		if (q->xfer_buf) {
-			u32_t maxsecs = (q->xfer_bufsz >> 9);
-			if ((u32_t)n > maxsecs) n = (int)maxsecs;
-		}
 	} else {
 		n = r->sectors_left;
 		if (n > (u32_t)u->pio_multi) n = (u32_t)u->pio_multi;
@@ -630,52 +1148,63 @@ ata_request(ata_ctrl_t *ac,ata_req_t *r,int arm_ticks)
 		/* POLL mode: allow multi-sector PIO up to u->pio_multi */
 	}
 
+	if (r->is_write) {
+		ata_lba_t at = r->lba + (r->xfer_off >> 9);
+
+		/* Count each request once, at its first chunk */
+		if (r->xfer_off == 0 && u->caps.phys_shift &&
+		    (ATA_PHYS_OFF(u, at) || ATA_PHYS_OFF(u, at + r->sectors_left)))
+			BUMP(ac,wr_misaligned);
+		n = ata_align_chunk(u, at, n, r->sectors_left);
+	}
+
 	bytes = (size_t)n << 9; /* * 512U */
 
 	r->lba_cur 	= r->lba + (r->xfer_off >> 9);
-	r->nsec 	= (u16_t)n;
-	r->chunk_left   = (u16_t)n;
+	r->nsec 	= (u32_t)n;
+	r->chunk_left   = (u32_t)n;
 	r->chunk_bytes  = (u32_t)bytes;
-	r->cmd          = multicmd(ac, r->is_write,r->lba_cur,n);
-	r->flags       &= ~ATA_RF_NEEDCOPY;
-
-	if (r->is_write) {
-		/* Write: prefer bounce buffer for IRQ path; copy from user if valid */
-		if (q->xfer_buf && valid_usr_range((addr_t)r->addr, bytes)) {
-			bcopy((caddr_t)r->addr + r->xfer_off, q->xfer_buf, bytes);
-			r->xptr = q->xfer_buf;
-		} else {
-			/* kernel buffers only */
-			r->xptr = (caddr_t)r->addr + r->xfer_off;
-		}
-	} else {
-		/* Read: receive into bounce buffer when available; copy back later if user VA */
-		if (q->xfer_buf) {
-			r->xptr = q->xfer_buf;
-			if (valid_usr_range((addr_t)r->addr, bytes))
-				r->flags |= ATA_RF_NEEDCOPY;
-		} else {
-			r->xptr = (caddr_t)r->addr + r->xfer_off;
-		}
+	r->cmd          = multicmd(ac, r->drive, r->is_write,r->lba_cur,n);
+
+	if (r->flags & ATA_RF_NODATA) {
+		r->cmd = (U_HAS_CAP(u,ACAP_LBA48) && 
+			  (n > 256 || r->lba_cur + n - 1 > ATA_LBA28_MAX)) ?
+			ATA_CMD_READ_VERIFY_EXT : ATA_CMD_READ_VERIFY;
+		r->xptr = NULL;
+		goto issue;
+	}
+	if (r->flags & ATA_RF_ZEROSRC) {
+		/* Every sector of the command comes from the zero sector */
+		r->xptr = (caddr_t)ata_zero_sec;
+		goto issue;
 	}
 
+	/*
+	 * Every ATA buffer is a kernel address by now (bp_mapin in
+	 * atabreakup, or a kio), so the data moves in place.
+	 */
+	BUMP(ac,xfer_direct);
+	r->xptr = (caddr_t)r->addr + r->xfer_off;
+
+issue:
 	ATADEBUG(5,"%s: ata_program_next_chunk(%s) blk=%lu count=%lu\n",
-		Cstr(ac),r->is_write?"Write":"Read",r->lba_cur,n);
+		Cstr(ac),r->is_write?"Write":"Read",ATA_LBA_LO(r->lba_cur),n);
 
 	s=splbio();
-	q->state = AS_XFER;
+	if (r->flags & ATA_RF_NODATA)
+		q->state = AS_EOC;
+	else
+		q->state = r->is_write ? AS_WAITDRQ : AS_XFER;
 	AC_SET_FLAG(ac,ACF_BUSY);
 	q->cur  = r;
 	splx(s);
 
+	if (!ata_hy_arm(ac, u, r) && AC_HAS_FLAG(ac,ACF_INTR_MODE) &&
+	    !AC_HAS_FLAG(ac,ACF_IRQ_ON))
+		ATA_IRQ_ON(ac);
 	ata_program_taskfile(ac, r);
 
-	/* reset DRQ wait budget for this chunk */
-	r->await_drq_ticks = HZ * 2;
-
 	if (arm_ticks) ide_arm_watchdog(ac,arm_ticks);
-
-	if (!AC_HAS_FLAG(ac,ACF_INTR_MODE)) ide_kick(ac);
 }
 
 void 
@@ -694,6 +1223,7 @@ ata_finish_current(ata_ctrl_t *ac, int err,int place)
 		return;
 	}
 	ide_cancel_watchdog(ac);
+	if (err) ata_tf_inval(ac);	/* error outputs overwrite the LBA */
 
 	que = ac->ioque;
 	if (!que) {
@@ -718,104 +1248,147 @@ ATADEBUG(9,"ata_finish(reqid: %lu)\n",r->reqid);
 	r->flags |= ATA_RF_DONE;
 	splx(s);
 
+	/* Finished without reaching ata_hy_spin(): unmask INTRQ */
+	if (r->flags & ATA_RF_HYSPIN) {
+		r->flags &= ~ATA_RF_HYSPIN;
+		ATA_IRQ_ON(ac);
+	}
+
 	bp = r->bp;
 	bytes_done = r->xfer_off;
 
+	/* READ VERIFY failure: the taskfile holds the first bad LBA */
+	if (err && (r->flags & ATA_RF_NODATA) && r->kio) {
+		ata_lba_t e = ata_read_err_lba(ac, ATA_CMD_IS_EXT(r->cmd));
+		if (e < r->lba_cur || e >= r->lba_cur + r->chunk_left)
+			e = r->lba_cur;
+		r->kio->err_lba = e;
+		bytes_done = (u32_t)(e - r->lba) << 9;
+	}
+
+	/* Partition metadata rewritten: next open re-reads it */
+	if (r->flags & ATA_RF_META)
+		ac->drive[r->drive]->fdisk_valid = 0;
+
 	if (bp) {
 		if (bytes_done > bp->b_bcount) bytes_done = bp->b_bcount;
 		resid = bp->b_bcount - bytes_done;
+	} else if (r->kio) {
+		u32_t total = r->kio->nsec << 9;
+		if (bytes_done > total) bytes_done = total;
+		resid = total - bytes_done;
 	} else {
 		bytes_done=0;
 		resid=0;
 	}
 
-	/*** Xfer done - now copy the buffer if needed ***/
-	if (!r->err && 
-	    !r->is_write && 
-	    (r->flags & ATA_RF_NEEDCOPY) && 
-	    que->xfer_buf && r->chunk_bytes) { 
-		caddr_t dst = (caddr_t)((char *)r->addr + (r->xfer_off - r->chunk_bytes));
-		if (valid_usr_range((addr_t)dst, r->chunk_bytes))
-			bcopy(que->xfer_buf, dst, r->chunk_bytes);
-		else
-			r->err = EFAULT;
-
-		r->flags &= ~ATA_RF_NEEDCOPY;
-	}
-
+	/*
+	 * Status is final and read, so the channel can go to the next
+	 * request now and its seek overlap the biodone below.
+	 */
 	s=splbio();
 AC_CLR_FLAG(ac,ACF_BUSY);
 que->cur = NULL;
 que->state = AS_IDLE;
 que->last_err = r->err;
 splx(s);
-if (bp) {
-		if (err) berror(bp,resid,EIO);
-		else     bok(bp,resid);
+
+	if (que->q_head) {
+		BUMP(ac,early_start);
+		ide_start(ac, 0);	/* issue only: the caller drives it */
 	}
 
-	if (r) kmem_free(r,sizeof(*r));
+	r->resid    = resid;
+	if (ata_defer_done && AC_HAS_FLAG(ac,ACF_IN_ISR)) {
+		/* Leave the rest to timeout level; the channel is running */
+		s=splbio();
+		r->next = NULL;
+		if (que->d_tail)
+			que->d_tail->next = r;
+		else
+			que->d_head = r;
+		que->d_tail = r;
+		if (!ac->done_id)
+			ac->done_id = timeout(ata_done_run, (caddr_t)ac, 1);
+		splx(s);
+		BUMP(ac,done_deferred);
+	} else {
+		ata_done_req(ac, r);
+	}
 	AC_SET_FLAG(ac,ACF_PENDING_KICK);
 }
 
-int
-ata_data_phase_service(ata_ctrl_t *ac, ata_req_t *r)
+/*
+ * Second half of ata_finish_current(): complete the buf or kio and
+ * free the request.  Touches no ports and no user addresses.
+ */
+void
+ata_done_req(ata_ctrl_t *ac, ata_req_t *r)
 {
-	u8_t ast;
-	int rc = 0;
+	int	s;
 
-	/* point xptr at the current transfer offset */
-	r->xptr = r->addr + r->xfer_off;
+	ata_bounce_put(ac);	/* no-op unless the queue is empty */
 
-	/* Wait briefly for BSY to clear and DRQ to assert */
-	if (ata_wait(ac, ATA_SR_DRQ|ATA_SR_DRDY, ATA_SR_BSY, 10000, &ast, 0)) {
-		ATADEBUG(2,"ata_data_phase: DRQ wait timeout %02x\n",ast);
-		r->err = ast;
-		return -1;
-	}
+	if (r->bp) {
+		ata_unit_t *u = ac->drive[r->drive];
+		int	mi = ATA_MINIDX(r->dev);
 
-	/* small settle delay */
-	drv_usecwait(10);
+		if (r->err) berror(r->bp,r->resid,EIO);
+		else        bok(r->bp,r->resid);
 
-	/* Consume exactly ONE 512B data phase per call in POLL mode.
-	 * Multi-sector PIO commands re-assert DRQ per sector; we must not
-	 * assume we can read multiple sectors back-to-back without waiting
-	 * for the next DRQ edge.
-	 */
-	if (pio_one_sector(ac, r) != 0) {
-		ATADEBUG(1,"ata_data_phase: pio_one_sector failed\n");
-		rc = -1;
+		/* Only now may ataclose() stop waiting on this minor */
+		s=splbio();
+		if (u->mio[mi] > 0 && --u->mio[mi] == 0)
+			wakeup((caddr_t)&u->mio[mi]);
+		splx(s);
+	} else if (r->kio) {
+		ata_kio_complete(r->kio, r->err ? EIO : 0, r->resid);
 	}
-
-	/* derive from bytes already transferred to avoid drift */
-	r->lba_cur = r->lba + (r->xfer_off >> 9);
-
-	return rc;
+	kmem_free(r,sizeof(*r));
 }
 
-
+/*
+ * timeout() handler: complete what the interrupt handler finished
+ * since the last run, oldest first.
+ */
 void
-ata_prime_write(ata_ctrl_t *ac, ata_req_t *r)
+ata_done_run(caddr_t arg)
 {
-	ata_ioque_t *q = ac->ioque;
-	u8_t	ast, err;
-	u8_t	drive = r->drive & 1;
-	int	er;
+	ata_ctrl_t  *ac = (ata_ctrl_t *)arg;
+	ata_ioque_t *que = ac->ioque;
+	ata_req_t   *r;
+	int	s;
 
-	if (ata_wait(ac,ATA_SR_DRQ,ATA_SR_BSY,1000000,&ast,&err) != 0) {
-		if (!(ast & ATA_SR_DRQ)) {
-			ATADEBUG(2,"ata_prime_write(): wait DRQ fail ST=%02x ER=%02x\n",ast,err);
-			return;
+	for (;;) {
+		s=splbio();
+		ac->done_id = 0;
+		r = que->d_head;
+		if (r) {
+			que->d_head = r->next;
+			if (!que->d_head) que->d_tail = NULL;
+			r->next = NULL;
 		}
+		splx(s);
+		if (!r) break;
+		ata_done_req(ac, r);
 	}
+}
 
-	if (!q) printf("que is null\n");
-	if (!r->xptr) printf("r->xptr is null\n");
-	
-	if (pio_one_sector(ac,r) != 0) {
-		/* Error */
-	}
-	return;
+/*
+ * Queue a request and start the channel if idle; does not wait.
+ */
+void
+ata_queuereq(ata_ctrl_t *ac, ata_req_t *r)
+{
+    int s;
+
+    s = splbio();
+    ide_q_put(ac, r);
+
+    if (AC_HAS_FLAG(ac, ACF_INTR_MODE) || !AC_HAS_FLAG(ac, ACF_POLL_RUNNING))
+        ide_kick(ac);
+
+    splx(s);
 }
 
 int
@@ -823,7 +1396,6 @@ ata_pushreq(ata_ctrl_t *ac, ata_req_t *r)
 {
     ata_ioque_t *que = ac ? ac->ioque : NULL;
     struct buf  *bp  = r ? r->bp : NULL;
-    int s;
 
     ATADEBUG(1, "ata_pushreq(%s: r->id=%ld flags=%08x)\n",
         Cstr(ac), r ? r->reqid : 0L, ac ? ac->flags : 0);
@@ -838,23 +1410,168 @@ ata_pushreq(ata_ctrl_t *ac, ata_req_t *r)
      * This matches the vanilla hd driver pattern (strategy + iowait/biodone),
      * and avoids controller-global SYNC_DONE races.
      */
-    s = splbio();
-    ide_q_put(ac, r);
-
-    if (AC_HAS_FLAG(ac, ACF_INTR_MODE) || !AC_HAS_FLAG(ac, ACF_POLL_RUNNING))
-        ide_kick(ac);
-
-    splx(s);
+    ata_queuereq(ac, r);
 
     iowait(bp);
     return (bp->b_flags & B_ERROR) ? bp->b_error : 0;
 }
 
+/*
+ * LBA from the taskfile after an error (the first failing sector for
+ * READ VERIFY).  The 48-bit high bytes are read back through HOB.
+ */
+ata_lba_t
+ata_read_err_lba(ata_ctrl_t *ac, int ext)
+{
+	u8_t	ctl = AC_HAS_FLAG(ac,ACF_IRQ_ON) ? ATA_CTL_IRQEN : ATA_CTL_NIEN;
+	ata_lba_t lba;
+
+	lba  = (u32_t)inb(ATA_LBA0_O(ac));
+	lba |= (u32_t)inb(ATA_LBA1_O(ac)) << 8;
+	lba |= (u32_t)inb(ATA_LBA2_O(ac)) << 16;
+	if (ext) {
+		outb(ATA_DEVCTRL_O(ac), ctl | ATA_CTL_HOB);
+		lba |= (ata_lba_t)inb(ATA_LBA0_O(ac)) << 24;
+		lba |= (ata_lba_t)inb(ATA_LBA1_O(ac)) << 32;
+		lba |= (ata_lba_t)inb(ATA_LBA2_O(ac)) << 40;
+		outb(ATA_DEVCTRL_O(ac), ctl);
+	} else {
+		lba |= (u32_t)(inb(ATA_DRVHD_O(ac)) & 0x0F) << 24;
+	}
+	return lba;
+}
+
+/* Source for ATA_RF_ZEROSRC writes */
+u32_t	ata_zero_sec[ATA_SECSIZE / sizeof(u32_t)];
+
+/*
+ * Queue an in-kernel request (see ata_kio_t).  Returns 0 once queued,
+ * else an errno and the kio is untouched.
+ */
+int
+ata_kio_submit(ata_kio_t *kp)
+{
+	ata_ctrl_t *ac;
+	ata_unit_t *u;
+	ata_req_t *r;
+	int	drive;
+
+	if (!kp || kp->unit < 0 || kp->unit >= ATA_MAX_UNITS) return ENXIO;
+	ac    = &ata_ctrl[ATA_CTRL_FROM_UNIT(kp->unit)];
+	drive = ATA_DRIVE_FROM_UNIT(kp->unit);
+	u     = ac->drive[drive];
+	if (!u || !U_HAS_FLAG(u,UF_PRESENT) || U_HAS_FLAG(u,UF_ATAPI)) 
+		return ENXIO;
+	if ((kp->flags & (ATA_KIO_VERIFY|ATA_KIO_WRITE)) == 
+	    (ATA_KIO_VERIFY|ATA_KIO_WRITE))
+		return EINVAL;
+	if (kp->flags & ATA_KIO_ZERO)
+		kp->flags |= ATA_KIO_WRITE;
+	if (kp->nsec == 0 || kp->nsec > ATA_KIO_MAXSEC ||
+	    (kp->addr == NULL && !(kp->flags & (ATA_KIO_VERIFY|ATA_KIO_ZERO))) ||
+	    kp->lba >= u->nsectors || kp->nsec > u->nsectors - kp->lba)
+		return EINVAL;
+
+	r = (ata_req_t *)kmem_zalloc(sizeof(*r),
+		(kp->flags & ATA_KIO_NOSLEEP) ? KM_NOSLEEP : KM_SLEEP);
+	if (!r) return ENOMEM;
+
+	kp->flags &= ~ATA_KIO_DONE;
+	kp->error  = 0;
+	kp->resid  = kp->nsec << 9;
+
+	r->is_write	= (kp->flags & ATA_KIO_WRITE) ? 1 : 0;
+	r->reqid	= req_seq++;
+	r->drive	= drive;
+	r->addr		= kp->addr;
+	r->kio		= kp;
+	r->lba		= kp->lba;
+	r->lba_cur	= r->lba;
+	r->nsec		= kp->nsec;
+	r->sectors_left	= r->nsec;
+	r->cmd		= multicmd(ac,drive,r->is_write,r->lba,r->nsec);
+	if (r->is_write && ata_meta_overlap(u,r->lba,r->nsec))
+		r->flags |= ATA_RF_META;
+	if (kp->flags & ATA_KIO_VERIFY)
+		r->flags |= ATA_RF_NODATA;
+	if (kp->flags & ATA_KIO_ZERO)
+		r->flags |= ATA_RF_ZEROSRC;
+	kp->err_lba = 0;
+
+	ATADEBUG(2,"ata_kio_submit(unit=%d %s lba=%lu nsec=%lu)\n",
+		kp->unit, r->is_write ? "WRITE" : "READ", ATA_LBA_LO(kp->lba), kp->nsec);
+
+	ata_queuereq(ac, r);
+	return 0;
+}
+
+/*
+ * Completion, from ata_finish_current().
+ */
+void
+ata_kio_complete(ata_kio_t *kp, int err, u32_t resid)
+{
+	int	s;
+
+	kp->error = err;
+	kp->resid = resid;
+	s = splbio();
+	kp->flags |= ATA_KIO_DONE;
+	splx(s);
+	if (kp->done) 
+		(*kp->done)(kp);
+	else
+		wakeup((caddr_t)kp);
+}
+
+/*
+ * Sleep until a kio submitted without a done routine finishes.
+ */
+int
+ata_kio_wait(ata_kio_t *kp)
+{
+	int	s;
+
+	s = splbio();
+	while (!(kp->flags & ATA_KIO_DONE))
+		sleep((caddr_t)kp, PRIBIO);
+	splx(s);
+	return kp->error;
+}
+
+/*
+ * Synchronous transfer to or from a kernel buffer.
+ */
+int
+ata_kio_rw(int unit, int flags, ata_lba_t lba, u32_t nsec, caddr_t addr)
+{
+	ata_kio_t kio;
+	int	rc;
+
+	bzero((caddr_t)&kio, sizeof(kio));
+	kio.unit  = unit;
+	kio.flags = flags & ~ATA_KIO_NOSLEEP;
+	kio.lba   = lba;
+	kio.nsec  = nsec;
+	kio.addr  = addr;
+	if ((rc = ata_kio_submit(&kio)) != 0) return rc;
+	return ata_kio_wait(&kio);
+}
+
+/*
+ * Choose the read/write opcode for a chunk.  The 48-bit forms are only
+ * used when the unit reports LBA48 and the chunk reaches beyond the
+ * 28-bit limit (or wants more than 256 sectors), since they cost twice
+ * the taskfile writes.
+ */
 int
-multicmd(ata_ctrl_t *ac, int is_write, u32_t lba, u32_t nsec)
+multicmd(ata_ctrl_t *ac, int drive, int is_write, ata_lba_t lba, u32_t nsec)
 {
-	int	use_ext = 0; /* (lba > 0xffffffff) && ac->lba48_ok;*/
-	int	multi_ok = (nsec>1) && (ac->pio_multi>1) && ac->multi_set_ok;
+	ata_unit_t *u = ac->drive[drive & 1];
+	int	use_ext = U_HAS_CAP(u,ACAP_LBA48) &&
+			  ((lba + nsec) > ATA_LBA28_MAX || 
+			   nsec > ATA_MAX_XFER_SECTORS);
+	int	multi_ok = (nsec>1) && (u->pio_multi>1) && u->multi_ok;
 
 	if (is_write) {
 		if (use_ext) return multi_ok ? ATA_CMD_WRITE_MULTI_EXT
@@ -95,6 +95,7 @@ atapi_dosend_packet(ata_ctrl_t *ac, int drive, u16_t byte_count,int where)
 	ata_sel(ac,drive,0);
 
 	/* FEAT=0, SECCNT=0, Byte Count in CYCLOW/HIGH */
+	ata_tf_inval(ac);
 	outb(ATA_FEAT_O(ac),    0x00);
 	outb(ATA_SECTCNT_O(ac), 0x00);
 	outb(ATA_CYLLOW_O(ac),  (u8_t)(byte_count & 0xFF));
@@ -559,6 +560,7 @@ atapi_start_irq(ata_ctrl_t *ac, ata_req_t *r)
 
 	/* Select drive and program the PACKET command with transfer length. */
 	ata_sel(ac, r->drive, 0);
+	ata_tf_inval(ac);
 	outb(ATA_FEAT_O(ac),    0x00);
 	outb(ATA_SECTCNT_O(ac), 0x00);
 	outb(ATA_SECTNUM_O(ac), 0x00);
@@ -719,7 +721,7 @@ atapi_request(ata_ctrl_t *ac, ata_req_t *r, int arm_ticks)
 	}
 
 	/* Decide max transfer size per CDB (aligned to device block). */
-	max_bytes = (q && q->xfer_bufsz) ? q->xfer_bufsz : blksz;
+	max_bytes = (q && q->xfer_bufsz) ? q->xfer_bufsz : ata_bpool.st.bufsz;
 	if (max_bytes < blksz) max_bytes = blksz;
 	max_bytes = (max_bytes / blksz) * blksz;
 
@@ -756,7 +758,7 @@ atapi_request(ata_ctrl_t *ac, ata_req_t *r, int arm_ticks)
 		r->atapi_dir   = r->is_write ? ATAPI_DIR_WRITE : ATAPI_DIR_READ;
 
 		s = splbio();
-		q->state = AS_XFER;
+		q->state = AS_PACKET;
 		AC_SET_FLAG(ac,ACF_BUSY);
 		q->cur   = r;
 		splx(s);
@@ -772,7 +774,6 @@ atapi_request(ata_ctrl_t *ac, ata_req_t *r, int arm_ticks)
  			return rc;
  		}
 
-		r->await_drq_ticks = HZ * 2;
 		if (arm_ticks) ide_arm_watchdog(ac, arm_ticks);
 
 		return 0;   /* transfer continues in atapi_service_irq() */
@@ -20,7 +20,7 @@ ataopen(dev_t *devp, int flags, int otyp, cred_t *crp)
 	ata_ioque_t *q = ac->ioque;
 	ata_unit_t *u = ac->drive[drive];
 	ata_part_t *fp=&u->fd[fdisk];
-	int	s;
+	int	s, mi;
 
 	ATADEBUG(1,"ataopen(%s) present=%d dev=%x part=%d ctrl=%d driv=%d slice=%d\n",
 		Dstr(dev),
@@ -34,36 +34,25 @@ ataopen(dev_t *devp, int flags, int otyp, cred_t *crp)
 	if (ISABSDEV(dev)) return ENXIO;
 
 	s=splbio();
-	if (AC_HAS_FLAG(ac, ACF_CLOSING)) {
-		splx(s);
-		return EBUSY;
-	}
 
-	/* Channel-scoped first-open allocation of bounce buffer */
+	/* Channel-scoped first-open engine reset */
 	if (q->open_count == 0) {
-
-		/*** Read the partition table ***/
-		if (ata_pdinfo(ABSDEV(dev)) != 0) {
-			splx(s);
-			return ENXIO;
-		}
-
-    		if (q->xfer_buf == 0) {
-        		q->xfer_buf = (caddr_t)kmem_zalloc(ATA_XFER_BUFSZ, KM_SLEEP);
-        		if (q->xfer_buf == 0)
-            			return ENOMEM;
-        		q->xfer_bufsz = ATA_XFER_BUFSZ;
-			ATADEBUG(5,"%s: xfer_buf=%lx\n",Cstr(ac),q->xfer_buf);
-    		}
 		AC_CLR_FLAG(ac,ACF_BUSY); 
 		q->state	= AS_IDLE;
 		q->cur		= NULL; /* opencount==0 */
 		ac->tmo_id	= 0;
 	}
-	
-	AC_CLR_FLAG(ac,ACF_CLOSING); 
 	splx(s);
 
+	/*
+	 * Partition tables are cached per unit and only re-read after
+	 * V_REMOUNT or a write that hit sector 0 or a VTOC sector.
+	 */
+	if (!U_HAS_FLAG(u,UF_ATAPI) && !u->fdisk_valid) {
+		if (ata_pdinfo(ABSDEV(dev)) != 0) 
+			return ENXIO;
+	}
+
 	if (U_HAS_FLAG(u,UF_ATAPI)) {
 		int	rc;
 		u32_t	blocks, blksz;
@@ -106,7 +95,15 @@ ataopen(dev_t *devp, int flags, int otyp, cred_t *crp)
 	}
 
 ok:
-	q->open_count++;
+	mi = ATA_MINIDX(dev);
+	s=splbio();
+	if (u->mopen[mi] == 0) {
+		u->nopen++;
+		q->open_count++;
+	}
+	if (otyp == OTYP_LYR) u->mlyr[mi]++;
+	u->mopen[mi] |= (u8_t)(1 << otyp);
+	splx(s);
 	return 0;
 }
 
@@ -117,7 +114,8 @@ ataclose(dev_t dev, int flags, int otyp, cred_t *crp)
 	ata_ioque_t *q = ac->ioque;
 	ata_unit_t *u = ac->drive[ATA_DRIVE(dev)];
 	ata_part_t *fp=&u->fd[ATA_PART(dev)];
-	int	s;
+	int	s, mi = ATA_MINIDX(dev);
+	u8_t	bit = (u8_t)(1 << otyp);
 
 	ATADEBUG(1,"ataclose(%s) present=%d fdisk_valid=%d vtoc_valid=%d\n",
 		Dstr(dev),
@@ -127,46 +125,79 @@ ataclose(dev_t dev, int flags, int otyp, cred_t *crp)
 	if (!U_HAS_FLAG(u,UF_PRESENT)) return ENODEV;
 
 	s=splbio();
-	AC_SET_FLAG(ac, ACF_CLOSING);
-	while (AC_HAS_FLAG(ac,ACF_BUSY) || q->q_head) {
-		ATADEBUG(2,"busy=%d q_head=%lx\n",AC_HAS_FLAG(ac,ACF_BUSY),q->q_head);
-		sleep((caddr_t)ac->ioque,PRIBIO);
+	if (otyp == OTYP_LYR && u->mlyr[mi] > 0 && --u->mlyr[mi] > 0) {
+		splx(s);
+		return 0;
+	}
+
+	/*
+	 * Last close of this minor: wait for its own requests only.  The
+	 * channel keeps dispatching for other slices and the other drive.
+	 * The open-type bit stays set while draining so that a racing
+	 * open of the same minor does not count it twice.
+	 */
+	if ((u->mopen[mi] & ~bit) == 0) {
+		while (u->mio[mi]) {
+			ATADEBUG(2,"ataclose(%s) draining %d\n",
+				Dstr(dev),u->mio[mi]);
+			sleep((caddr_t)&u->mio[mi],PRIBIO);
+		}
+	}
+	u->mopen[mi] &= ~bit;
+	if (u->mopen[mi]) {
+		splx(s);
+		return 0;
 	}
 
+	/* Async requests nobody reaped through this minor go with it */
+	ata_aio_flush(u, dev);
+	if (u->nopen > 0) u->nopen--;
 	if (q->open_count > 0) q->open_count--;
 
-	if (q->open_count == 0) {
-		if (q->xfer_buf) {
-			ATADEBUG(5,"ataclose(%s: free %lx\n",
-				Cstr(ac),q->xfer_buf);
-			kmem_free(q->xfer_buf,q->xfer_bufsz);
-			q->xfer_buf  = 0;
-			q->xfer_bufsz = 0;
-		}
-		u->fdisk_valid=0;
+	if (q->open_count == 0 && !q->cur && !q->q_head) 
 		reset_queue(ac,0);
-	}
-	AC_CLR_FLAG(ac,ACF_CLOSING);
 	splx(s);
 	return 0;
 
 }
 
+/*
+ * Raw I/O.  physiock() has already locked the user pages; map them
+ * into kernel space and hand the whole transfer to atastrategy(),
+ * which moves it in place in commands sized from the unit's IDENTIFY
+ * data (ata_intr_chunk).  ATAPI units keep the pio_breakup() path,
+ * whose CDB sizing still works in staging-buffer pieces.
+ */
 void
 atabreakup(struct buf *bp)
 {
-	pio_breakup(atastrategy, bp, MAXNBLKS);
+	ata_unit_t *u = &ata_unit[ATA_UNIT(bp->b_edev)];
+
+	if (U_HAS_FLAG(u,UF_ATAPI)) {
+		pio_breakup(atastrategy, bp, MAXNBLKS);
+		return;
+	}
+
+	bp_mapin(bp);
+	atastrategy(bp);	/* synchronous: returns after biodone */
+	bp_mapout(bp);
 }
 
-int
-atastrategy(struct buf *bp)
+/*
+ * Build the request for a buf and count it against minor odev, the
+ * one the caller opened (the buf may address ABSDEV).  On failure the
+ * buf has been completed with an error and NULL returned.
+ */
+ata_req_t *
+ata_mkreq(struct buf *bp, dev_t odev)
 {
 	int	dev=bp->b_edev, is_wr, s, do_kick;
 	ata_ctrl_t *ac = &ata_ctrl[ATA_CTRL(dev)];
 	ata_unit_t *u = ac->drive[ATA_DRIVE(dev)];
 	ata_ioque_t *q = ac->ioque;
 	ata_req_t *r;
-	u32_t	base, len, lba, left;
+	ata_lba_t base;
+	u32_t	len, lba, left;
 	char	*addr;
 
 	/*
@@ -188,9 +219,23 @@ atastrategy(struct buf *bp)
 		bp->b_flags);
 
 	ata_region_from_dev(dev,&base,&len);
-	
+
+	/*
+	 * The engine moves data in place, possibly from another
+	 * process's context: a buf that still holds a user address
+	 * (not mapped by atabreakup or pio_breakup) is refused.
+	 */
+	if (bp->b_bcount && 
+	    valid_usr_range((addr_t)bp->b_un.b_addr, bp->b_bcount)) {
+		berror(bp,bp->b_bcount,EFAULT);
+		return NULL;
+	}
+
 	r = (ata_req_t *)kmem_zalloc(sizeof(*r),KM_SLEEP);
-	if (!r) return berror(bp,0,ENOMEM);
+	if (!r) {
+		berror(bp,0,ENOMEM);
+		return NULL;
+	}
 
 	r->is_write = (bp->b_flags & B_READ) ? 0 : 1;
 	r->reqid    = req_seq++;
@@ -203,7 +248,7 @@ atastrategy(struct buf *bp)
 		u32_t bsz512 = blksz >> 9;
 		if (bsz512 == 0) bsz512=1;
 
-		r->lba          = base / bsz512 + (u32_t)bp->b_blkno / bsz512;
+		r->lba          = ATA_LBA_LO(base) / bsz512 + (u32_t)bp->b_blkno / bsz512;
 		r->lba_cur      = r->lba;
 		r->nsec         = (u32_t)(bp->b_bcount / blksz);
 		r->sectors_left = r->nsec;
@@ -211,27 +256,42 @@ atastrategy(struct buf *bp)
 		r->atapi_phase	= ATAPI_PHASE_WAIT_PKT_DRQ;
 		r->atapi_dir	= r->is_write ?ATAPI_DIR_WRITE :ATAPI_DIR_READ;
 		r->atapi_use_dma= 0;
-		ATADEBUG(1,"r->lba=%ld r->nsec=%ld\n",r->lba, r->nsec);
+		ATADEBUG(1,"r->lba=%ld r->nsec=%ld\n",ATA_LBA_LO(r->lba), r->nsec);
 	} else {
 		r->lba          = base + (u32_t)bp->b_blkno;
 		r->lba_cur      = r->lba;
 		r->nsec         = (u32_t)(bp->b_bcount >> 9);
 		r->sectors_left = r->nsec;
-		r->cmd 		= multicmd(ac,r->is_write,bp->b_blkno,r->nsec);
+		r->cmd 		= multicmd(ac,r->drive,r->is_write,r->lba,r->nsec);
+		if (r->is_write && ata_meta_overlap(u,r->lba,r->nsec))
+			r->flags |= ATA_RF_META;
 	}
 
-	ata_pushreq(ac,r);
+	/* Per-minor outstanding count, drained by ataclose() */
+	r->dev = odev;
+	s = splbio();
+	u->mio[ATA_MINIDX(odev)]++;
+	splx(s);
+	return r;
+}
+
+int
+atastrategy(struct buf *bp)
+{
+	ata_req_t *r;
+
+	if ((r = ata_mkreq(bp, bp->b_edev)) == NULL) return 0;
+	ata_pushreq(&ata_ctrl[ATA_CTRL(bp->b_edev)],r);
 	return 0;
 }
 
 int
 ataread(dev_t dev, struct uio *uiop, cred_t *crp)
 {
-	int 	fdisk = ATA_PART(dev),
-		slice = ATA_SLICE(dev);
 	ata_unit_t *u = &ata_unit[ATA_UNIT(dev)];
 	daddr_t	maxb;
-	u32_t	blksz;
+	ata_lba_t base;
+	u32_t	blksz, len;
 	u32_t	bsz512;
 
 	ATADEBUG(1,"ataread(%s)\n",Dstr(dev));
@@ -246,7 +306,9 @@ ataread(dev_t dev, struct uio *uiop, cred_t *crp)
 		if (bsz512 == 0) bsz512 = 1;
 		maxb = (daddr_t)(u->atapi_blocks * bsz512);
 	} else {
-		maxb = (daddr_t)(u->fd[fdisk].slice[slice].p_size);
+		/* Same region atabreakup maps: non-UNIX partitions have no slices */
+		ata_region_from_dev(dev, &base, &len);
+		maxb = (daddr_t)len;
 	}
 
 	return physiock(atabreakup, 
@@ -260,11 +322,10 @@ ataread(dev_t dev, struct uio *uiop, cred_t *crp)
 int
 atawrite(dev_t dev, struct uio *uiop, cred_t *crp)
 {
-	int 	fdisk = ATA_PART(dev),
-		slice = ATA_SLICE(dev);
 	ata_unit_t *u = &ata_unit[ATA_UNIT(dev)];
 	daddr_t	maxb;
-	u32_t	blksz;
+	ata_lba_t base;
+	u32_t	blksz, len;
 	u32_t	bsz512;
 
 	ATADEBUG(1,"atawrite(%s)\n",Dstr(dev));
@@ -279,7 +340,9 @@ atawrite(dev_t dev, struct uio *uiop, cred_t *crp)
 		if (bsz512 == 0) bsz512 = 1;
 		maxb = (daddr_t)(u->atapi_blocks * bsz512);
 	} else {
-		maxb = (daddr_t)(u->fd[fdisk].slice[slice].p_size);
+		/* Same region atabreakup maps: non-UNIX partitions have no slices */
+		ata_region_from_dev(dev, &base, &len);
+		maxb = (daddr_t)len;
 	}
 
 	return physiock(atabreakup, 
@@ -308,12 +371,16 @@ ataioctl(dev_t dev, int cmd, caddr_t arg, int mode, cred_t *crp, int *rvalp)
 		return 0;
 
 	case V_REMOUNT: /* VIOC | 0x02 */
-		if (fp->nsectors > 0 && fp->systid == UNIXOS) 
-			fp->vtoc_valid = ata_read_vtoc(dev,fdisk);
+		/* Drop the cached tables and re-read them now */
+		if (U_HAS_FLAG(u,UF_ATAPI)) return 0;
+		u->fdisk_valid = 0;
+		if (ata_pdinfo(ABSDEV(dev)) != 0) return EIO;
 		return 0;
 	
 	case V_GETPARMS: {	/* VIOC | 0x04 */
 		struct disk_parms dp;
+		u32_t	nsec = ATA_LBA_HI(u->nsectors) ? 0xFFFFFFFFUL 
+						      : ATA_LBA_LO(u->nsectors);
 
 		/*
 		 * We dont have geometry; supply logical CHS compatible 
@@ -322,13 +389,13 @@ ataioctl(dev_t dev, int cmd, caddr_t arg, int mode, cred_t *crp, int *rvalp)
 		dp.dp_type   = 1;
 		dp.dp_heads  = 16;
 		dp.dp_sectors= 63;
-		dp.dp_cyls   = (u16_t)(u->nsectors/(dp.dp_heads*dp.dp_sectors));
+		dp.dp_cyls   = (u16_t)(nsec/(dp.dp_heads*dp.dp_sectors));
 		dp.dp_secsiz = DEV_BSIZE;
 		dp.dp_ptag   = 0;
 		dp.dp_pflag  = 0;
 		/*dp.dp_pstartsec = 0;*/
 		dp.dp_pstartsec = 1;
-		dp.dp_pnumsec  = u->nsectors;
+		dp.dp_pnumsec  = nsec;
 
 		if (copyout((caddr_t)&dp, arg, sizeof(dp)) < 0)
 			return EFAULT;
@@ -346,62 +413,208 @@ ataioctl(dev_t dev, int cmd, caddr_t arg, int mode, cred_t *crp, int *rvalp)
 		return 0;
 	    }
 	
-	case V_RDABS: {		/* VIOC | 0x0A */
+	case V_RDABS: 		/* VIOC | 0x0A */
+	case V_WRABS: {		/* VIOC | 0x0B */
         	struct absio ab;
-		caddr_t	ptr;
+		ata_seg_t sg;
+		int	rc, nfail;
 
-		printf("copyin\n");
+		if (U_HAS_FLAG(u,UF_ATAPI)) return ENOTTY;
         	if (copyin(arg, (caddr_t)&ab, sizeof(ab)) != 0) return EFAULT;
         	if (ab.abs_buf == 0) return EINVAL;
 
-		if (!(ptr = (caddr_t)kmem_alloc(ATA_SECSIZE,KM_SLEEP))) {
-			return ENOMEM;
+		sg.lba  = (u32_t)ab.abs_sec;
+		sg.nsec = 1;
+		sg.buf  = (caddr_t)ab.abs_buf;
+		/* Addressed to the whole disk, drained by this minor's close */
+		rc = ata_batch(ABSDEV(dev), dev, &sg, 1, cmd == V_WRABS, &nfail);
+		return rc ? rc : sg.status;
+	    }
+
+	case ATAIOC_BATCH: {
+		ata_batch_t bt;
+		ata_seg_t *sg;
+		u32_t	sz;
+		int	rc, nfail;
+
+		if (U_HAS_FLAG(u,UF_ATAPI)) return ENOTTY;
+		if (copyin(arg, (caddr_t)&bt, sizeof(bt)) != 0) return EFAULT;
+		if (bt.nseg <= 0 || bt.nseg > ATA_BATCH_MAXSEG) return EINVAL;
+		if (bt.flags & ATA_BATCH_WRITE) {
+			if (!(mode & FWRITE)) return EBADF;
+			if (u->read_only) return EROFS;
 		}
-		printf("call ata_getblock(%d)\n",ab.abs_sec);
-    		if (ata_getblock(ABSDEV(dev),ab.abs_sec,ptr,ATA_SECSIZE)) {
-			kmem_free(ptr,ATA_SECSIZE);
+
+		sz = (u32_t)bt.nseg * sizeof(ata_seg_t);
+		sg = (ata_seg_t *)kmem_alloc(sz, KM_SLEEP);
+		if (!sg) return ENOMEM;
+		if (copyin((caddr_t)bt.segs, (caddr_t)sg, sz) != 0) {
+			kmem_free((caddr_t)sg, sz);
 			return EFAULT;
 		}
-		printf("call copyout()\n");
-                if (copyout(ptr,ab.abs_buf,ATA_SECSIZE) != 0) {
-			kmem_free(ptr,ATA_SECSIZE);
-			return EFAULT; 
-		}
-		kmem_free(ptr,ATA_SECSIZE);
-                return 0;
+		rc = ata_batch(dev, dev, sg, bt.nseg, 
+				(bt.flags & ATA_BATCH_WRITE) != 0, &nfail);
+		if (rc == 0 && copyout((caddr_t)sg, (caddr_t)bt.segs, sz) != 0)
+			rc = EFAULT;
+		kmem_free((caddr_t)sg, sz);
+		if (rc == 0) *rvalp = nfail;
+		return rc;
 	    }
-	
-	case V_WRABS: {		/* VIOC | 0x0B */
-        	struct absio ab;
-		caddr_t	ptr;
 
-        	if (copyin(arg,(caddr_t)&ab,sizeof(ab)) != 0) return EFAULT;
-        	if (ab.abs_buf == 0) return EINVAL;
+	case ATAIOC_SUBMIT: {
+		ata_aio_t aio;
 
-		if (!(ptr = (caddr_t)kmem_alloc(ATA_SECSIZE,KM_SLEEP))) {
-			return ENOMEM;
+		if (U_HAS_FLAG(u,UF_ATAPI)) return ENOTTY;
+		if (copyin(arg, (caddr_t)&aio, sizeof(aio)) != 0) return EFAULT;
+		if (aio.flags & ATA_AIO_WRITE) {
+			if (!(mode & FWRITE)) return EBADF;
+			if (u->read_only) return EROFS;
 		}
-                if (copyin((caddr_t)ab.abs_buf,ptr,ATA_SECSIZE) != 0) { 
-			kmem_free(ptr,ATA_SECSIZE);
-			return EFAULT; 
-		} 
-    		if (ata_putblock(ABSDEV(dev),ab.abs_sec,ptr,ATA_SECSIZE) != 0) {
-			kmem_free(ptr,ATA_SECSIZE);
-			return EIO;
-		}
-		kmem_free(ptr,ATA_SECSIZE);
-                return 0;
+		return ata_aio_submit(dev, &aio);
+	    }
+
+	case ATAIOC_REAP: {
+		ata_reap_t rp;
+		ata_aiodone_t done[ATA_AIO_MAX];
+		int	rc;
+
+		if (copyin(arg, (caddr_t)&rp, sizeof(rp)) != 0) return EFAULT;
+		if (rp.max <= 0 || rp.min < 0) return EINVAL;
+		if (rp.max > ATA_AIO_MAX) rp.max = ATA_AIO_MAX;
+		if ((rc = ata_aio_reap(dev, &rp, done)) != 0) return rc;
+		if (rp.n && copyout((caddr_t)done, (caddr_t)rp.done, 
+				rp.n * sizeof(done[0])) != 0) 
+			return EFAULT;
+		if (copyout((caddr_t)&rp, arg, sizeof(rp)) != 0) return EFAULT;
+		*rvalp = rp.n;
+		return 0;
 	    }
 
 	case V_VERIFY: {	/* VIOC | 0x0C */
     		union vfy_io vfy;
-
-		vfy.vfy_out.err_code=0;
-		if (copyout((caddr_t)&vfy,arg,sizeof(vfy)) < 0)
+		ata_lba_t base;
+		u32_t	len, sec, n, bad, done;
+		int	nbad, rc;
+
+		if (U_HAS_FLAG(u,UF_ATAPI)) return ENOTTY;
+		if (copyin(arg,(caddr_t)&vfy,sizeof(vfy)) != 0) return EFAULT;
+		sec = (u32_t)vfy.vfy_in.abs_sec;
+		n   = (u32_t)vfy.vfy_in.num_sec;
+
+		/* abs_sec is absolute on the disk */
+		ata_region_from_dev(ABSDEV(dev),&base,&len);
+		if (n == 0 || sec >= len || n > len - sec) return EINVAL;
+
+		rc = ata_verify_range(ATA_UNIT(dev),sec,n,&bad,1,&nbad,&done);
+		if (rc) return rc;
+		vfy.vfy_out.abs_sec  = nbad ? (long)(sec + bad) : 0;
+		vfy.vfy_out.err_code = nbad ? 1 : 0;
+		if (copyout((caddr_t)&vfy,arg,sizeof(vfy)) != 0)
 			return EFAULT;
 		return 0;
 	    }
 
+	case ATAIOC_ZERO: {
+		ata_zero_t z;
+		ata_lba_t base;
+		u32_t	len;
+
+		if (U_HAS_FLAG(u,UF_ATAPI)) return ENOTTY;
+		if (!(mode & FWRITE)) return EBADF;
+		if (u->read_only) return EROFS;
+		if (copyin(arg,(caddr_t)&z,sizeof(z)) != 0) return EFAULT;
+		ata_region_from_dev(dev,&base,&len);
+		if (z.nsec == 0 || z.lba >= len || z.nsec > len - z.lba)
+			return EINVAL;
+		return ata_zero_range(ATA_UNIT(dev), base + z.lba, z.nsec);
+	    }
+
+	case ATAIOC_COPY: {
+		ata_copy_t cp;
+		ata_unit_t *du;
+		ata_lba_t sbase, dbase, sa, da;
+		u32_t	slen, dlen;
+		int	rc;
+
+		if (U_HAS_FLAG(u,UF_ATAPI)) return ENOTTY;
+		if (drv_priv(crp) != 0) return EPERM;
+		if (copyin(arg,(caddr_t)&cp,sizeof(cp)) != 0) return EFAULT;
+
+		/* Only then does the minor name one of our units */
+		if (getmajor(cp.dst_dev) != getmajor(dev)) return ENXIO;
+		du = &ata_unit[ATA_UNIT(cp.dst_dev)];
+		if (!U_HAS_FLAG(du,UF_PRESENT) || U_HAS_FLAG(du,UF_ATAPI) ||
+		    ISABSDEV(cp.dst_dev)) 
+			return ENXIO;
+		if (du->read_only) return EROFS;
+		if (!du->mopen[ATA_MINIDX(cp.dst_dev)]) return EBADF;
+
+		ata_region_from_dev(dev,&sbase,&slen);
+		ata_region_from_dev(cp.dst_dev,&dbase,&dlen);
+		if (cp.nsec == 0 ||
+		    cp.src_lba >= slen || cp.nsec > slen - cp.src_lba ||
+		    cp.dst_lba >= dlen || cp.nsec > dlen - cp.dst_lba)
+			return EINVAL;
+
+		/* Writes trail reads: refuse an overlapping copy upwards */
+		sa = sbase + cp.src_lba;
+		da = dbase + cp.dst_lba;
+		if (du == u && da > sa && da < sa + cp.nsec) return EINVAL;
+
+		rc = ata_copy_range(ATA_UNIT(dev), sa, ATA_UNIT(cp.dst_dev), da,
+				cp.nsec, &cp.done);
+		if (copyout((caddr_t)&cp,arg,sizeof(cp)) != 0 && rc == 0) 
+			rc = EFAULT;
+		return rc;
+	    }
+
+	case ATAIOC_TRIM:
+		/* DSM is a DMA command; this driver is PIO-only */
+		return ENOTTY;
+
+	case ATAIOC_VERIFY: {
+		ata_verify_t vf;
+		ata_lba_t base;
+		u32_t	len, *bad;
+		int	i, rc;
+
+		if (U_HAS_FLAG(u,UF_ATAPI)) return ENOTTY;
+		if (copyin(arg,(caddr_t)&vf,sizeof(vf)) != 0) return EFAULT;
+		ata_region_from_dev(dev,&base,&len);
+		if (vf.nsec == 0 || vf.lba >= len || vf.nsec > len - vf.lba)
+			return EINVAL;
+		if (vf.maxbad < 0) return EINVAL;
+		if (vf.maxbad > ATA_VERIFY_MAXBAD) 
+			vf.maxbad = ATA_VERIFY_MAXBAD;
+		if (vf.maxbad > 0 && vf.bad == NULL) return EINVAL;
+
+		bad = (u32_t *)kmem_alloc((vf.maxbad ? vf.maxbad : 1) * sizeof(u32_t),
+				KM_SLEEP);
+		if (!bad) return ENOMEM;
+		rc = ata_verify_range(ATA_UNIT(dev), base + vf.lba, vf.nsec,
+				bad, vf.maxbad, &vf.nbad, &vf.done);
+		for (i = 0; i < vf.nbad; i++) bad[i] += vf.lba;
+		if (rc == 0 && vf.nbad &&
+		    copyout((caddr_t)bad,(caddr_t)vf.bad,vf.nbad*sizeof(u32_t)) != 0)
+			rc = EFAULT;
+		kmem_free((caddr_t)bad, (vf.maxbad ? vf.maxbad : 1) * sizeof(u32_t));
+		if (rc == 0 && copyout((caddr_t)&vf,arg,sizeof(vf)) != 0) 
+			rc = EFAULT;
+		if (rc == 0) *rvalp = vf.nbad;
+		return rc;
+	    }
+
+	case ATAIOC_GETCAPS:
+		if (U_HAS_FLAG(u,UF_ATAPI)) return ENOTTY;
+		if (copyout((caddr_t)&u->caps,arg,sizeof(u->caps)) != 0) 
+			return EFAULT;
+		return 0;
+
+	case ATAIOC_POOLSTAT:
+		if (copyout((caddr_t)&ata_bpool.st,arg,sizeof(ata_bpool.st)) != 0) 
+			return EFAULT;
+		return 0;
+
 	case V_GETTYPE: {
 		struct v_gettype gt;
 
@@ -552,7 +765,8 @@ atasize(dev_t dev)
 	if (!U_HAS_FLAG(u,UF_PRESENT)) return -1;
 
 	if (U_HAS_FLAG(u,UF_ATAPI) || !u->fd[fdisk].vtoc_valid)
-		return (int)u->nsectors;
+		return (u->nsectors > 0x7FFFFFFF) ? 0x7FFFFFFF 
+						  : (int)u->nsectors;
 
 	return (int)u->fd[fdisk].slice[slice].p_size;
 }
@@ -560,7 +774,7 @@ atasize(dev_t dev)
 int
 atainit(void)
 {
-	int 	ctrl; 
+	int 	ctrl, mask = 0; 
 	ata_ioque_t *q;
 	ata_ctrl_t *ac;
 	ata_counters_t *counters;
@@ -571,10 +785,10 @@ atainit(void)
 	if (bfreelist.av_forw == NULL) binit();
 
 	bzero((caddr_t)&ata_unit[0],sizeof(ata_unit_t)*ATA_MAX_UNITS);
+	ata_bounce_init();
 	for (ctrl = 0; ctrl < ATA_MAX_CTRL; ctrl++) {
 		ac = &ata_ctrl[ctrl];
 		ac->idx = ctrl;
-		ac->multi_set_ok = 0; /* disable MULTIPLE until proven */
 
 		q = (ata_ioque_t *)kmem_zalloc(sizeof(ata_ioque_t),KM_SLEEP);
 		if (!q) return -1;
@@ -587,6 +801,7 @@ atainit(void)
 		ac->sel_drive = -1;
 		ac->sel_hi4 = 0xff;
 		ac->sel_mode = 0;
+		ata_tf_inval(ac);
 
 		ac->drive[ 0 ] = &ata_unit[ATA_UNIT_FROM(ctrl,0)];
 		ac->drive[ 1 ] = &ata_unit[ATA_UNIT_FROM(ctrl,1)];
@@ -594,8 +809,14 @@ atainit(void)
 		ac->drive[0]->drive = 0;
 		ac->drive[1]->drive = 1;
 
-		if (AC_HAS_FLAG(ac,ACF_PRESENT)) ata_attach(ctrl);
+		if (AC_HAS_FLAG(ac,ACF_PRESENT)) mask |= (1 << ctrl);
+	}
+
+	/* Probe all channels together */
+	ata_probe_ctrls(mask);
 
+	for (ctrl = 0; ctrl < ATA_MAX_CTRL; ctrl++) {
+		ac = &ata_ctrl[ctrl];
 		if (AC_HAS_FLAG(ac,ACF_INTR_MODE)) {
 			/*
 			 * If in Interrupt mode as opposed POLL mode
@@ -645,11 +866,12 @@ ataintr(int irq)
 	r = q ? q->cur : NULL;	/* ataintr() */
 
 	BUMP(ac,irq_seen);
+	/*
+	 * The one status read of the interrupt: it acknowledges INTRQ
+	 * and is handed down as is.  ERROR is left to whoever handles
+	 * the failure.
+	 */
 	st=inb(ATA_STATUS_O(ac)); /* ataintr() */
- 	err=(st & (ATA_SR_ERR|ATA_SR_DWF)) ? inb(ATA_ERROR_O(ac)) : 0;
-	if (err) {
-		printf("Drive ERR:DWF\n");
-	}
 
 	if (!AC_HAS_FLAG(ac, ACF_INTR_MODE)) {
 		BUMP(ac,irq_spurious);
@@ -658,6 +880,7 @@ ataintr(int irq)
 
 	if (!r) { 
 		ast=inb(ATA_ALTSTATUS_O(ac));
+		err=(st & (ATA_SR_ERR|ATA_SR_DWF)) ? inb(ATA_ERROR_O(ac)) : 0;
 		drvs=inb(ATA_DRVHD_O(ac));
 		u = ac->drive[ (drvs & ATA_DH_DRV) ? 1 : 0 ];
 
@@ -671,7 +894,7 @@ ataintr(int irq)
 		printf("STRAY %s: ST=%02x ERR=%02x AST=%02x q=%p cur=%p last: cmd=%02x lba=%ld sc=%d dh=%02x reqid=%d age=%lu\n",
 			Cstr(ac),st,err,ast,
 			q,q?q->cur:NULL,
-			ac->lc.cmd,ac->lc.lba,ac->lc.sc,ac->lc.dh,ac->lc.reqid,
+			ac->lc.cmd,ATA_LBA_LO(ac->lc.lba),ac->lc.sc,ac->lc.dh,ac->lc.reqid,
 			(lbolt-ac->lc.tick));
 
 		return DDI_INTR_CLAIMED;
@@ -681,16 +904,13 @@ ataintr(int irq)
 	AC_SET_FLAG(ac,ACF_IN_ISR);
 	BUMP(ac, irq_handled);
 
-	/* ATAPI IRQ dispatch */
-    	if (r->cmd == ATA_CMD_PACKET) 
-		atapi_service_irq(ac, r, st); 
-	else
-		ata_service_irq(ac, r, st);
+	ata_sm_run(ac, r, st, ATA_EV_IRQ);
 
-	AC_CLR_FLAG(ac,ACF_IN_ISR);
+	/* Still ACF_IN_ISR: nothing started from here spins */
 	if (AC_HAS_FLAG(ac,ACF_PENDING_KICK)) {
 		AC_CLR_FLAG(ac,ACF_PENDING_KICK);
 		ide_kick_internal(ac);
 	}
+	AC_CLR_FLAG(ac,ACF_IN_ISR);
 	return DDI_INTR_CLAIMED;
 }
@@ -34,6 +34,13 @@ extern	int 	ata_intr_mode;
 extern	int 	atapi_intr_mode;
 extern 	ata_unit_t ata_unit[];
 extern	u32_t req_seq;
+extern	u32_t	ata_zero_sec[];
+extern	int	ata_bounce_bufsz;
+extern	int	ata_bounce_nbuf;
+extern	int	ata_tf_shadow;
+extern	int	ata_defer_done;
+extern	int	ata_hybrid_max_us;
+extern	ata_bpool_t ata_bpool;
 
 /*** ide_core ***/
 void 	ataprint(dev_t, char *);
@@ -41,6 +48,7 @@ int 	ataopen(dev_t *, int, int, cred_t *);
 int 	ataclose(dev_t, int, int, cred_t *);
 void 	atabreakup(struct buf *);
 int 	atastrategy(struct buf *);
+ata_req_t *ata_mkreq(struct buf *, dev_t);
 int 	ataread(dev_t, struct uio *, cred_t *);
 int 	atawrite(dev_t, struct uio *, cred_t *);
 int 	ataioctl(dev_t, int, caddr_t, int, cred_t *, int *);
@@ -53,17 +61,25 @@ int 	ataintr(int);
 void 	ide_arm_watchdog(ata_ctrl_t *, int);
 void 	ide_cancel_watchdog(ata_ctrl_t *);
 void 	ide_watchdog(caddr_t);
-void 	ide_start(ata_ctrl_t *);
+void 	ide_start(ata_ctrl_t *, int);
 ata_req_t *ide_q_get(ata_ctrl_t *);
 void 	ide_q_put(ata_ctrl_t *, ata_req_t *);
 void 	ide_kick(ata_ctrl_t *);
+void 	ide_kick_internal(ata_ctrl_t *);
 void 	ide_need_kick(ata_ctrl_t *);
 
 /*** ide_ata ***/
 int 	ata_sel(ata_ctrl_t *,int, u32_t);
 void 	ata_delay400(ata_ctrl_t *);
+void	ata_tf_inval(ata_ctrl_t *);
+void	ata_tf_out(ata_ctrl_t *, int, u8_t);
+void	ata_tf_out48(ata_ctrl_t *, int, u8_t, u8_t);
+void	ata_tf_probe(ata_ctrl_t *, u8_t);
 int 	ata_wait(ata_ctrl_t *, u8_t, u8_t, long, u8_t *, u8_t *);
+int 	ata_regs_respond(ata_ctrl_t *);
 int 	ata_identify(ata_ctrl_t *, int);
+void 	ata_parse_identify(ata_unit_t *, u16_t *);
+void 	ata_identify_done(ata_ctrl_t *, int, u16_t *);
 int 	ata_flush_cache(ata_ctrl_t *,u8_t);
 void 	ata_quiesce_ctrl(ata_ctrl_t *);
 void	ata_dump_stats(void);
@@ -74,15 +90,26 @@ int 	ata_err(ata_ctrl_t *, u8_t *, u8_t *);
 void 	ata_rescue(int);
 void 	ata_rescueit(ata_ctrl_t *);
 int 	pio_one_sector(ata_ctrl_t *, ata_req_t *);
-void 	ata_service_irq(ata_ctrl_t *, ata_req_t *, u8_t);
+void	ata_sm_step(ata_ctrl_t *, ata_req_t *, u8_t, int);
+void	ata_sm_arm(ata_ctrl_t *);
+u8_t	ata_sm_sample(ata_ctrl_t *);
+void	ata_sm_run(ata_ctrl_t *, ata_req_t *, u8_t, int);
 void 	ata_program_taskfile(ata_ctrl_t *, ata_req_t *);
 int 	ata_program_next_chunk(ata_ctrl_t *,ata_req_t *,int);
 int 	ata_prog_pio(ata_ctrl_t *,ata_req_t *,int);
 void 	ata_finish_current(ata_ctrl_t *, int,int);
-int 	ata_data_phase_service(ata_ctrl_t *,ata_req_t *);
-void 	ata_prime_write(ata_ctrl_t *, ata_req_t *);
+void	ata_done_req(ata_ctrl_t *, ata_req_t *);
+void	ata_done_run(caddr_t);
+u32_t	ata_intr_chunk(ata_ctrl_t *, ata_unit_t *, u32_t);
+u32_t	ata_align_chunk(ata_unit_t *, ata_lba_t, u32_t, u32_t);
 int	ata_pushreq(ata_ctrl_t *,ata_req_t *);
-int	multicmd(ata_ctrl_t *,int,u32_t,u32_t);
+void	ata_queuereq(ata_ctrl_t *,ata_req_t *);
+int	ata_kio_submit(ata_kio_t *);
+ata_lba_t ata_read_err_lba(ata_ctrl_t *, int);
+void	ata_kio_complete(ata_kio_t *, int, u32_t);
+int	ata_kio_wait(ata_kio_t *);
+int	ata_kio_rw(int, int, ata_lba_t, u32_t, caddr_t);
+int	multicmd(ata_ctrl_t *,int,int,ata_lba_t,u32_t);
 
 /*** ide_atapi ***/
 void 	atapi_program_packet(ata_ctrl_t *, ata_req_t *, u16_t);
@@ -120,20 +147,43 @@ char 	*getstr(char *, int, int, int, int);
 void	ATADEBUG(int,char *,...);
 int 	ata_getblock(dev_t, daddr_t, caddr_t, u32_t);
 int 	ata_putblock(dev_t, daddr_t, caddr_t, u32_t);
+int 	ata_batch(dev_t, dev_t, ata_seg_t *, int, int, int *);
+int 	ata_verify_range(int, ata_lba_t, u32_t, u32_t *, int, int *, u32_t *);
+int 	ata_zero_range(int, ata_lba_t, u32_t);
+int 	ata_copy_range(int, ata_lba_t, int, ata_lba_t, u32_t, u32_t *);
+int 	ata_aio_submit(dev_t, ata_aio_t *);
+void 	ata_aio_done(struct buf *);
+void 	ata_aio_release(ata_unit_t *, ata_aioslot_t *);
+int 	ata_aio_reap(dev_t, ata_reap_t *, ata_aiodone_t *);
+int 	ata_aio_queued(ata_unit_t *);
+int 	ata_aio_mine(ata_unit_t *, caddr_t, dev_t, int);
+void 	ata_aio_flush(ata_unit_t *, dev_t);
 int 	berror(struct buf *, int, int);
 int 	bok(struct buf *, int);
 char 	*Cstr(ata_ctrl_t *);
 char 	*Dstr(dev_t);
+char 	*Lstr(ata_lba_t);
 char 	*Istr(int);
 void 	reset_queue(ata_ctrl_t *,int);
+void 	ata_bounce_init(void);
+void 	ata_bounce_get(ata_ctrl_t *);
+void 	ata_bounce_put(ata_ctrl_t *);
 void 	ata_attach(int);
+void 	ata_probe_ctrls(int);
+u16_t 	ata_classify_sig(u8_t, u8_t);
 int 	ata_read_vtoc(dev_t, int);
 void 	ata_copy_model(u16_t *, char *);
 int 	ata_read_signature(ata_ctrl_t *, u8_t, u16_t *);
 int 	ata_probe_unit(ata_ctrl_t *,u8_t);
-void 	ata_region_from_dev(dev_t, u32_t *, u32_t *);
+void 	ata_region_from_dev(dev_t, ata_lba_t *, u32_t *);
 void 	CopyTbl(ata_part_t *,struct ipart *);
 int 	ata_pdinfo(dev_t);
+void 	ata_setup_part(dev_t, int);
+int 	ata_walk_ebr(dev_t, u32_t, int, caddr_t);
+u32_t	ata_crc32(u8_t *, u32_t);
+int 	ata_read_gpt(dev_t, caddr_t);
+void 	ata_check_align(ata_ctrl_t *, ata_unit_t *);
+int 	ata_meta_overlap(ata_unit_t *, ata_lba_t, u32_t);
 void 	ide_poll_engine(ata_ctrl_t *);
 
 #endif /* _IDE_FUNCS_H */
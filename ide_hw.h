@@ -28,6 +28,8 @@
 /* Choose PIO Multiple policy: 1=max drive-supported, 0=cap at 8 */
 #define ATA_USE_MAX_MULTIPLE 1
 #define ATA_MAX_XFER_SECTORS 256 /* 128KiB per command */
+#define ATA_MAX_XFER_SECTORS_EXT 65536 /* 32MiB per LBA48 command */
+#define ATA_LBA28_MAX	0x0FFFFFFFUL
 
 #define ATA_MAX_RETRIES 3
 
@@ -79,7 +81,14 @@
 #define ATA_SR_BSY   		0x80	/* Drive is busy */
 #define ATA_ERR(ast)		((ast&(ATA_SR_ERR|ATA_SR_DWF)) != 0)
 
+/* Error register bits */
+#define ATA_ER_ABRT		0x04	/* Command aborted */
+
+/* Nothing drives the bus: pulled-up data lines (with or without D7 pull-down) */
+#define ATA_ST_FLOATING(st)	((st) == 0xFF || (st) == 0x7F)
+
 /* Devctl */
+#define ATA_CTL_HOB 		0x80	/* Read back 48-bit high bytes */
 #define ATA_CTL_SRST 		0x04	/* Software Reset */
 #define ATA_CTL_NIEN 		0x02	/* Disable INTRQ */
 #define ATA_CTL_IRQEN 		0x00	/* Enable INTRQ */
@@ -123,11 +132,96 @@
 #define ATA_CMD_WRITE_MULTI	0xC5
 #define ATA_CMD_WRITE_MULTI_EXT	0x39
 #define ATA_CMD_READ_SEC_RETRY  0x21
+#define ATA_CMD_READ_VERIFY	0x40
+#define ATA_CMD_READ_VERIFY_EXT	0x42
 #define ATA_CMD_FLUSH_CACHE     0xE7
 #define ATA_CMD_FLUSH_CACHE_EXT 0xEA
 #define ATA_CMD_PACKET          0xA0
 #define ATA_CMD_IDENTIFY_PKT    0xA1
 #define ATA_CMD_SET_MULTI	0xC6
+#define ATA_CMD_SET_FEATURES	0xEF
+
+#define ATA_SF_SPINUP		0x07	/* SET FEATURES: PUIS spin-up */
+
+/* IDENTIFY word 2 values for drives powered up in standby (PUIS) */
+#define ATA_ID2_SPINUP_INCOMPLETE 0x37C8
+#define ATA_ID2_SPINUP_COMPLETE	  0x738C
+
+/* Boot probe timing (ata_probe_ctrls) */
+#define ATA_PROBE_POLL_US	10		/* sweep interval */
+#define ATA_PROBE_BSY_US	500000L		/* reset / select */
+#define ATA_PROBE_DRQ_US	500000L		/* IDENTIFY data */
+#define ATA_PROBE_SPINUP_US	10000000L	/* PUIS spin-up */
+
+/* Longest chase of a polled engine state before a tick takes over */
+#define ATA_QUICK_US		10
+
+/* POLL mode: ide_poll_engine() yields after this many blocks or usecs idle */
+#define ATA_POLL_BURST		32
+#define ATA_POLL_SPIN_US	500000L
+
+/* Requests one ata_sm_run() follows before leaving the next to its
+   interrupt or tick */
+#define ATA_SM_CHAIN		4
+
+/* Hybrid completion (ata_hy_arm): floor of the spin window, and how
+   often a unit too slow to spin is sampled again at the full window */
+#define ATA_HY_SLACK_US		10
+#define ATA_HY_PROBE		32
+
+#define ATA_CMD_IS_EXT(c)	((c) == ATA_CMD_READ_SEC_EXT    || \
+				 (c) == ATA_CMD_READ_MULTI_EXT  || \
+				 (c) == ATA_CMD_READ_VERIFY_EXT || \
+				 (c) == ATA_CMD_WRITE_SEC_EXT   || \
+				 (c) == ATA_CMD_WRITE_MULTI_EXT)
+#define ATA_CMD_IS_WRITE(c)	((c) == ATA_CMD_WRITE_SEC       || \
+				 (c) == ATA_CMD_WRITE_MULTI     || \
+				 (c) == ATA_CMD_WRITE_SEC_EXT   || \
+				 (c) == ATA_CMD_WRITE_MULTI_EXT)
+/* READ/WRITE MULTIPLE: one DRQ (and interrupt) per pio_multi sectors */
+#define ATA_CMD_IS_MULTI(c)	((c) == ATA_CMD_READ_MULTI      || \
+				 (c) == ATA_CMD_READ_MULTI_EXT  || \
+				 (c) == ATA_CMD_WRITE_MULTI     || \
+				 (c) == ATA_CMD_WRITE_MULTI_EXT)
+/* Plain reads/writes: the only commands that keep the taskfile shadow */
+#define ATA_CMD_IS_RW(c)	((c) == ATA_CMD_READ_SEC        || \
+				 (c) == ATA_CMD_READ_MULTI      || \
+				 (c) == ATA_CMD_READ_VERIFY     || \
+				 (c) == ATA_CMD_WRITE_SEC       || \
+				 (c) == ATA_CMD_WRITE_MULTI     || \
+				 (c) == ATA_CMD_READ_SEC_EXT    || \
+				 (c) == ATA_CMD_READ_MULTI_EXT  || \
+				 (c) == ATA_CMD_READ_VERIFY_EXT || \
+				 (c) == ATA_CMD_WRITE_SEC_EXT   || \
+				 (c) == ATA_CMD_WRITE_MULTI_EXT)
+
+/* IDENTIFY DEVICE word offsets (see ata_identify()) */
+#define ATA_ID_CONFIG		0
+#define ATA_ID_MODEL		27
+#define ATA_ID_MAX_MULTI	47	/* bits 7:0 max sectors per DRQ block */
+#define ATA_ID_CAPS		49	/* bit 9 LBA, bit 8 DMA */
+#define ATA_ID_FIELD_VALID	53	/* bit 1 words 64-70, bit 2 word 88 */
+#define ATA_ID_CUR_MULTI	59	/* bit 8 valid, bits 7:0 current */
+#define ATA_ID_LBA28_LO		60
+#define ATA_ID_LBA28_HI		61
+#define ATA_ID_MWDMA		63
+#define ATA_ID_PIO_MODES	64
+#define ATA_ID_ADD_SUPPORTED	69	/* bit 14 DRAT, bit 5 RZAT */
+#define ATA_ID_QUEUE_DEPTH	75
+#define ATA_ID_MAJOR		80
+#define ATA_ID_CMDSET1		82	/* bit 5 write cache, bit 6 look-ahead */
+#define ATA_ID_CMDSET2		83	/* bit 10 LBA48, bit 12/13 flush(ext) */
+#define ATA_ID_CMDSET1_EN	85
+#define ATA_ID_CMDSET2_EN	86
+#define ATA_ID_UDMA		88	/* 7:0 supported, 15:8 selected */
+#define ATA_ID_LBA48		100	/* words 100..103 */
+#define ATA_ID_DSM_MAX		105	/* max 512B DSM payload blocks */
+#define ATA_ID_SECTOR_SIZE	106	/* bit 14 valid, 13 multi log/phys, 12 long log */
+#define ATA_ID_LOG_SECSZ	117	/* words 117..118, in 16-bit words */
+#define ATA_ID_DSM		169	/* bit 0 TRIM */
+#define ATA_ID_ALIGNMENT	209	/* bit 14 valid, 13:0 logical offset */
+
+#define ATA_ID_WORD_VALID(w)	(((w) & 0xC000) == 0x4000)
 
 /* ATAPI CDB opcodes */
 #define CDB_TEST_UNIT_READY     0x00
@@ -2,7 +2,6 @@
 #include <stdarg.h>
 #include <sys/cmn_err.h>
 
-extern void ata_service_irq(ata_ctrl_t *ac, ata_req_t *r, u8_t st);
 
 #define BS	0x08
 
@@ -67,7 +66,7 @@ void
 CopyTbl(ata_part_t *fp,struct ipart *ipart)
 {
 	fp->active   = ipart->bootid;
-	fp->base_lba = (u32_t)ipart->relsect;
+	fp->base_lba = (ata_lba_t)(u32_t)ipart->relsect;
 	fp->nsectors = (u32_t)ipart->numsect;
 	fp->systid   = (int)ipart->systid;
 }
@@ -125,6 +124,21 @@ static	char	buf[50];
 	return buf;
 }
 
+/*
+ * Printable sector number: decimal while it fits 32 bits, else hex.
+ */
+char *
+Lstr(ata_lba_t lba)
+{
+static	char	buf[24];
+
+	if (ATA_LBA_HI(lba))
+		sprintf(buf,"0x%lx%08lx",ATA_LBA_HI(lba),ATA_LBA_LO(lba));
+	else
+		sprintf(buf,"%lu",ATA_LBA_LO(lba));
+	return buf;
+}
+
 char *
 Istr(int cmd)
 {
@@ -139,6 +153,15 @@ Istr(int cmd)
 	case V_VERIFY:	 return "V_VERIFY";
 	case CDIOC_READTOC: return "CDIOC_READTOC";
 	case CDIOC_PLAYMSF: return "CDIOC_PLAYMSF";
+	case ATAIOC_GETCAPS: return "ATAIOC_GETCAPS";
+	case ATAIOC_POOLSTAT: return "ATAIOC_POOLSTAT";
+	case ATAIOC_BATCH: return "ATAIOC_BATCH";
+	case ATAIOC_SUBMIT: return "ATAIOC_SUBMIT";
+	case ATAIOC_REAP: return "ATAIOC_REAP";
+	case ATAIOC_VERIFY: return "ATAIOC_VERIFY";
+	case ATAIOC_ZERO: return "ATAIOC_ZERO";
+	case ATAIOC_COPY: return "ATAIOC_COPY";
+	case ATAIOC_TRIM: return "ATAIOC_TRIM";
 	default:	 return "V_default";
 	}
 }
@@ -159,31 +182,339 @@ reset_queue(ata_ctrl_t *ac,int hard)
 	AC_CLR_FLAG(ac, ACF_BUSY);
 }
 
+ata_bpool_t ata_bpool;
+
+/*
+ * Allocate the bounce pool once at boot.  A short pool is not fatal:
+ * an ATAPI request that misses sizes its CDBs by st.bufsz alone.  No
+ * data is ever staged through the pool, so a miss never leaves a user
+ * address for the engine; ata_mkreq() refuses those outright.
+ */
 void
-ata_attach(int ctrl)
+ata_bounce_init(void)
 {
-	ata_ctrl_t *ac= &ata_ctrl[ctrl];
-	int 	i, drive, rc=-1;
+	ata_bpool_t *bp = &ata_bpool;
+	u32_t	sz = (u32_t)ata_bounce_bufsz;
+	int	i, n = ata_bounce_nbuf;
+
+	if (sz < ATA_XFER_MINSZ) sz = ATA_XFER_MINSZ;
+	if (sz > ((u32_t)ATA_MAX_XFER_SECTORS_EXT << 9))
+		sz = (u32_t)ATA_MAX_XFER_SECTORS_EXT << 9;
+	sz &= ~(u32_t)(ATA_SECSIZE-1);
+	if (n < 1) n = 1;
+	if (n > ATA_BOUNCE_MAXBUF) n = ATA_BOUNCE_MAXBUF;
+
+	bzero((caddr_t)bp,sizeof(*bp));
+	bp->st.bufsz = sz;
+	for (i = 0; i < n; i++) {
+		bp->buf[i] = (caddr_t)kmem_zalloc(sz, KM_SLEEP);
+		if (!bp->buf[i]) break;
+		bp->st.nbuf++;
+	}
+	ATADEBUG(1,"ata_bounce_init: %lu x %lu bytes\n",
+		bp->st.nbuf, bp->st.bufsz);
+}
+
+/*
+ * Bind a pool buffer to the channel for an ATAPI request, which sizes
+ * its CDB transfers from it.  ATA requests move data in place and take
+ * none.  Called with the queue about to start work; never sleeps.
+ */
+void
+ata_bounce_get(ata_ctrl_t *ac)
+{
+	ata_ioque_t *q = ac->ioque;
+	ata_bpool_t *bp = &ata_bpool;
+	int	i, s;
+
+	s = splbio();
+	for (i = 0; i < (int)bp->st.nbuf && !q->xfer_buf; i++) {
+		if (bp->owner[i] != NULL) continue;
+		bp->owner[i] = ac;
+		if (++bp->st.inuse > bp->st.hiwat)
+			bp->st.hiwat = bp->st.inuse;
+		q->xfer_buf   = bp->buf[i];
+		q->xfer_bufsz = bp->st.bufsz;
+		bp->st.binds++;
+	}
+	if (!q->xfer_buf) bp->st.misses++;
+	splx(s);
+	ATADEBUG(5,"%s: xfer_buf=%lx\n",Cstr(ac),q->xfer_buf);
+}
+
+/*
+ * Hand the channel's buffer back once nothing is queued or in flight.
+ */
+void
+ata_bounce_put(ata_ctrl_t *ac)
+{
+	ata_ioque_t *q = ac->ioque;
+	ata_bpool_t *bp = &ata_bpool;
+	int	i, s;
 
+	s = splbio();
+	if (!q->xfer_buf || q->cur || q->q_head) {
+		splx(s);
+		return;
+	}
+	for (i = 0; i < (int)bp->st.nbuf; i++) {
+		if (bp->owner[i] == ac) {
+			bp->owner[i] = NULL;
+			bp->st.inuse--;
+		}
+	}
+	q->xfer_buf   = 0;
+	q->xfer_bufsz = 0;
+	splx(s);
+}
+
+/*
+ * Attach a single controller.  Boot attaches every configured
+ * controller at once through ata_probe_ctrls().
+ */
+void
+ata_attach(int ctrl)
+{
 	ATADEBUG(1,"ata_attach(%d)\n",ctrl);
+	ata_probe_ctrls(1 << ctrl);
+}
+
+static void
+ata_probe_select(ata_ctrl_t *ac)
+{
+	outb(ATA_DRVHD_O(ac), ATA_DH(ac->pdrive,0,0));
+	ata_delay400(ac);
+	ac->sel_drive = ac->pdrive;
+	ac->sel_mode  = SEL_CHS;
+	ac->sel_hi4   = 0;
+	ata_tf_inval(ac);
+	ac->psig_cmd  = 0;
+	ac->pspinup   = 0;
+	ac->pstate    = PS_SIG;
+	ac->pbudget   = ATA_PROBE_BSY_US;
+}
+
+static void
+ata_probe_next(ata_ctrl_t *ac)
+{
+	if (++ac->pdrive < ATA_MAX_DRIVES) {
+		ata_probe_select(ac);
+		return;
+	}
+	ac->pstate = PS_DONE;
+}
+
+static void
+ata_probe_identify(ata_ctrl_t *ac, ata_unit_t *u)
+{
+	outb(ATA_CMD_O(ac), (u->devtype & DEV_ATAPI) ? ATA_CMD_IDENTIFY_PKT
+						     : ATA_CMD_IDENTIFY);
+	ac->pstate  = PS_IDENT;
+	ac->pbudget = ATA_PROBE_DRQ_US;
+}
+
+/*
+ * Advance one channel's probe by at most one step.  Never waits: it
+ * samples ALTSTATUS once and either moves on or leaves the state as is
+ * for the next sweep of ata_probe_ctrls().
+ */
+static void
+ata_probe_step(ata_ctrl_t *ac)
+{
+	ata_unit_t *u = ac->drive[ac->pdrive];
+	u16_t	id[256];
+	u8_t	st, lc, hc;
+
+	st = inb(ATA_ALTSTATUS_O(ac));
+	ac->pbudget -= ATA_PROBE_POLL_US;
+
+	switch (ac->pstate) {
+	case PS_RESET:
+		if (ATA_ST_FLOATING(st)) {
+			/* Nothing on this channel at all */
+			ATADEBUG(1,"%s: floating bus ST=%02x\n",Cstr(ac),st);
+			U_CLR_FLAG(ac->drive[0],UF_PRESENT);
+			U_CLR_FLAG(ac->drive[1],UF_PRESENT);
+			ac->pstate = PS_DONE;
+			return;
+		}
+		if (st & ATA_SR_BSY) {
+			if (ac->pbudget > 0) return;
+			ATADEBUG(1,"%s: BSY after reset ST=%02x\n",Cstr(ac),st);
+			ac->pstate = PS_DONE;
+			return;
+		}
+		ac->pdrive = 0;
+		ata_probe_select(ac);
+		return;
+
+	case PS_SIG:
+		if (ATA_ST_FLOATING(st)) break;
+		if (st & ATA_SR_BSY) {
+			if (ac->pbudget > 0) return;
+			break;
+		}
+		lc = inb(ATA_CYLLOW_O(ac));
+		hc = inb(ATA_CYLHIGH_O(ac));
+		u->devtype = ata_classify_sig(lc,hc);
+		ATADEBUG(1,"%s: signature lc=%02x hc=%02x ST=%02x\n",
+			Cstr(ac),lc,hc,st);
+
+		if (!ac->psig_cmd) {
+			/*
+			 * Missing slave: device 0 answers for it with
+			 * status 00h, and a position with nothing behind
+			 * it does not latch registers.  Only ATAPI devices
+			 * legitimately show 00h here.
+			 */
+			if (st == 0 && !(u->devtype & DEV_ATAPI)) break;
+			if (!ata_regs_respond(ac)) break;
+		}
+
+		if (u->devtype == DEV_UNKNOWN) {
+			if (ac->psig_cmd) break;
+			/* Old style: IDENTIFY forces the signature out */
+			ac->psig_cmd = 1;
+			ac->pbudget  = ATA_PROBE_BSY_US;
+			outb(ATA_CMD_O(ac), ATA_CMD_IDENTIFY);
+			return;
+		}
+		if (u->devtype & DEV_ATAPI) U_SET_FLAG(u,UF_ATAPI);
+
+		if (ac->psig_cmd && (st & ATA_SR_DRQ) && 
+		    !(u->devtype & DEV_ATAPI)) {
+			/* IDENTIFY data from the signature command is ready */
+			ac->pstate  = PS_IDENT;
+			ac->pbudget = ATA_PROBE_DRQ_US;
+			return;
+		}
+		ata_probe_identify(ac,u);
+		return;
+
+	case PS_IDENT:
+		if (st & (ATA_SR_ERR|ATA_SR_DWF)) break;
+		if ((st & ATA_SR_BSY) || !(st & ATA_SR_DRQ)) {
+			if (ac->pbudget > 0) return;
+			break;
+		}
+		insw(ATA_DATA_O(ac),id,256);
+		(void)inb(ATA_STATUS_O(ac));	/* ack INTRQ */
+
+		if (!(u->devtype & DEV_ATAPI) && !ac->pspinup &&
+		    (id[2] == ATA_ID2_SPINUP_INCOMPLETE ||
+		     id[2] == ATA_ID2_SPINUP_COMPLETE)) {
+			/* Powered up in standby: spin it up, then re-IDENTIFY */
+			ac->pspinup = 1;
+			printf("%s: spinning up drive %d\n",Cstr(ac),ac->pdrive);
+			outb(ATA_FEAT_O(ac), ATA_SF_SPINUP);
+			outb(ATA_CMD_O(ac), ATA_CMD_SET_FEATURES);
+			ac->pstate  = PS_SPINUP;
+			ac->pbudget = ATA_PROBE_SPINUP_US;
+			return;
+		}
+		/* Spun up once and the IDENTIFY data is still partial */
+		if (!(u->devtype & DEV_ATAPI) &&
+		    id[2] == ATA_ID2_SPINUP_INCOMPLETE)
+			break;
+		ata_identify_done(ac,ac->pdrive,id);
+		ata_probe_next(ac);
+		return;
+
+	case PS_SPINUP:
+		if (st & ATA_SR_BSY) {
+			if (ac->pbudget > 0) return;
+			break;
+		}
+		if (st & (ATA_SR_ERR|ATA_SR_DWF)) {
+			printf("%s: drive %d refused spin-up\n",Cstr(ac),ac->pdrive);
+			break;
+		}
+		ata_probe_identify(ac,u);
+		return;
 
-	if (!AC_HAS_FLAG(ac,ACF_PRESENT)) return;
+	default:
+		ac->pstate = PS_DONE;
+		return;
+	}
+
+	/* No usable device at this position */
+	U_CLR_FLAG(u,UF_PRESENT);
+	ata_probe_next(ac);
+}
+
+/*
+ * Probe every controller in mask together.  All channels are reset at
+ * once and a single polling loop then drives each channel's probe state
+ * machine, so reset recovery, spin-up and IDENTIFY on one channel
+ * overlap with the others instead of adding up.  Interrupts and the
+ * callout table are not usable yet this early, hence the sweep.
+ */
+void
+ata_probe_ctrls(int mask)
+{
+	ata_ctrl_t *ac;
+	int 	ctrl, drive, active;
+
+	ATADEBUG(1,"ata_probe_ctrls(%x)\n",mask);
+
+	for (ctrl = 0; ctrl < ATA_MAX_CTRL; ctrl++) {
+		ac = &ata_ctrl[ctrl];
+		ac->pstate = PS_DONE;
+		if (!(mask & (1 << ctrl)) || !AC_HAS_FLAG(ac,ACF_PRESENT)) 
+			continue;
+
+		if (ata_intr_mode || atapi_intr_mode) {
+			RegisterIRQ(ac->irq,&ataintr, SPL5, INTR_TRIGGER_EDGE);
+			AC_SET_FLAG(ac,ACF_INTR_MODE);
+		}
+		for (drive = 0; drive < ATA_MAX_DRIVES; drive++) {
+			ata_unit_t *u = ac->drive[drive];
+
+			bzero((caddr_t)u,sizeof(*u));
+			u->drive	= drive;
+			u->pio_multi	= 1;		/* 1 sector xfers */
+			u->atapi_blocks = 0;
+			u->atapi_blksz  = 0;
+		}
 
-	if (ata_intr_mode || atapi_intr_mode) {
-		RegisterIRQ(ac->irq,&ataintr, SPL5, INTR_TRIGGER_EDGE);
-		AC_SET_FLAG(ac,ACF_INTR_MODE);
+		/* Assert SRST on every channel before waiting on any */
+		BUMP(ac,softresets);
+		AC_CLR_FLAG(ac,ACF_IRQ_ON);
+		outb(ATA_DEVCTRL_O(ac), ATA_CTL_SRST | ATA_CTL_NIEN);
+		ac->pstate  = PS_RESET;
+		ac->pbudget = ATA_PROBE_BSY_US;
+		ac->pdrive  = 0;
 	}
 	if (ata_intr_mode) printf("ATA in intr mode\n");
 	if (atapi_intr_mode) printf("ATAPI in intr mode\n");
-	ata_softreset_ctrl(ac);
-	for (drive = 0; drive <= 1; drive++) {
-		ata_unit_t *u = ac->drive[drive];
 
-		bzero((caddr_t)u,sizeof(*u));
-		u->pio_multi=1;		/* 1 sector xfers */
-		u->atapi_blocks = 0;
-		u->atapi_blksz  = 0;
-		ata_probe_unit(ac,drive);
+	drv_usecwait(10);
+	for (ctrl = 0; ctrl < ATA_MAX_CTRL; ctrl++) {
+		ac = &ata_ctrl[ctrl];
+		if (ac->pstate == PS_RESET)
+			outb(ATA_DEVCTRL_O(ac), ATA_CTL_NIEN); /* deassert SRST */
+	}
+	drv_usecwait(2000);	/* status is not valid for 2ms after SRST */
+
+	do {
+		active = 0;
+		for (ctrl = 0; ctrl < ATA_MAX_CTRL; ctrl++) {
+			ac = &ata_ctrl[ctrl];
+			if (ac->pstate == PS_DONE) continue;
+			ata_probe_step(ac);
+			if (ac->pstate != PS_DONE) active++;
+		}
+		if (active) drv_usecwait(ATA_PROBE_POLL_US);
+	} while (active);
+
+	/* Per-unit follow-up (ATAPI INQUIRY, SET MULTIPLE, banner) */
+	for (ctrl = 0; ctrl < ATA_MAX_CTRL; ctrl++) {
+		ac = &ata_ctrl[ctrl];
+		if (!(mask & (1 << ctrl)) || !AC_HAS_FLAG(ac,ACF_PRESENT)) 
+			continue;
+		for (drive = 0; drive < ATA_MAX_DRIVES; drive++)
+			if (U_HAS_FLAG(ac->drive[drive],UF_PRESENT))
+				ata_probe_unit(ac,drive);
 	}
 }
 
@@ -195,7 +526,8 @@ ata_read_vtoc(dev_t dev,int part)
 		drive = ATA_DRIVE(dev);
 	ata_ctrl_t *ac = &ata_ctrl[ctrl];
 	ata_unit_t *u=ac->drive[drive];
-	u32_t 	base, lba, off;
+	ata_lba_t base, lba;
+	u32_t 	off;
 	caddr_t k = 0;
 	struct pdinfo *pd;
 	struct vtoc *v;
@@ -218,7 +550,7 @@ ata_read_vtoc(dev_t dev,int part)
 	lba = base + (u32_t)VTOC_SEC;
 	if (!(k = kmem_alloc(DEV_BSIZE, KM_SLEEP))) return 0;
 
-        if (ata_getblock(ABSDEV(dev),lba,(caddr_t)k,DEV_BSIZE) != 0) {
+	if (ata_kio_rw(ATA_UNIT(dev), 0, lba, 1, k) != 0) {
 		kmem_free(k, DEV_BSIZE);
 		return EIO;
 	}
@@ -284,6 +616,20 @@ ata_copy_model(u16_t *id, char *dst)
 	}
 }
 
+u16_t
+ata_classify_sig(u8_t lc, u8_t hc)
+{
+	switch ((hc<<8)|lc)
+	{
+	case 0x0000: return DEV_ATA|DEV_PARALLEL;
+	case 0x0800: return DEV_ATA|DEV_PARALLEL;
+	case 0xC33C: return DEV_ATA|DEV_SERIAL;
+	case 0xEB14: return DEV_ATAPI|DEV_PARALLEL;
+	case 0x9669: return DEV_ATAPI|DEV_SERIAL;
+	default:     return DEV_UNKNOWN;
+	}
+}
+
 int
 ata_read_signature(ata_ctrl_t *ac, u8_t drive,u16_t *type)
 {
@@ -294,6 +640,11 @@ ata_read_signature(ata_ctrl_t *ac, u8_t drive,u16_t *type)
 
 	if (ata_sel(ac,drive,0) != 0) return EIO;
 
+	/* Floating bus or nothing latching registers: absent, no waiting */
+	st = inb(ATA_ALTSTATUS_O(ac));
+	if (ATA_ST_FLOATING(st)) return ENXIO;
+	if (!(st & ATA_SR_BSY) && !ata_regs_respond(ac)) return ENXIO;
+
 	/*** Send an CMD_IDENTIFY to force the signature info on the bus ***/
 	outb(ATA_CMD_O(ac), ATA_CMD_IDENTIFY);
 
@@ -304,15 +655,7 @@ ata_read_signature(ata_ctrl_t *ac, u8_t drive,u16_t *type)
 	hc = inb(ATA_CYLHIGH_O(ac));
 	ATADEBUG(1,"read_signature() lc=%02x hc=%02x\n",lc,hc);
 
-	switch ((hc<<8)|lc)
-	{
-	case 0x0000: dev = DEV_ATA|DEV_PARALLEL; 	break;
-	case 0x0800: dev = DEV_ATA|DEV_PARALLEL; 	break;
-	case 0xC33C: dev = DEV_ATA|DEV_SERIAL; 		break;
-	case 0xEB14: dev = DEV_ATAPI|DEV_PARALLEL; 	break;
-	case 0x9669: dev = DEV_ATAPI|DEV_SERIAL; 	break;
-	default:     dev = DEV_UNKNOWN;			break;
-	}
+	dev = ata_classify_sig(lc,hc);
 	*type = dev;
 	return (dev == DEV_UNKNOWN) ? -1 : 0;
 }
@@ -325,13 +668,13 @@ ata_probe_unit(ata_ctrl_t *ac, u8_t drive)
 	u32_t	type;
 	char 	*klass;
 
+	/*
+	 * Signature and IDENTIFY have already been collected by the probe
+	 * engine (ata_probe_ctrls); finish bringing the unit up.
+	 */
 	ATADEBUG(3,"ata_probe_unit(%d)\n",drive);
 	if (!AC_HAS_FLAG(ac,ACF_PRESENT)) return ENXIO;
-
-	if (ata_read_signature(ac,drive,&u->devtype) != 0) return ENXIO;
-	if (u->devtype & DEV_ATAPI) U_SET_FLAG(u,UF_ATAPI);
-
-	if (ata_identify(ac, drive) != 0) return ENXIO;
+	if (!U_HAS_FLAG(u,UF_PRESENT)) return ENXIO;
  
 	ac->tmo_id    = 0;
 	ac->tmo_ticks = drv_usectohz(2000000); /* 2s is sane for PIO */
@@ -374,12 +717,13 @@ ata_probe_unit(ata_ctrl_t *ac, u8_t drive)
                        Cstr(ac),klass,u->model,med,u->atapi_blksz);
 
 	} else { /* ATA disk branch */
-		char 	*lba28 = u->lba_ok ? "LBA28" : "";
-		unsigned long nsec = u->nsectors;
+		char 	*lba28 = U_HAS_CAP(u,ACAP_LBA48) ? "LBA48" :
+				 u->lba_ok ? "LBA28" : "";
+		ata_lba_t nsec = u->nsectors;
 
-		ulong_t mib = nsec >> 11; 
-		ulong_t gib_i = nsec / 2097152UL;
-		ulong_t gib_tenths = ((nsec % 2097152UL) * 10UL) / 2097152UL;
+		ulong_t mib = (ulong_t)(nsec >> 11); 
+		ulong_t gib_i = (ulong_t)(nsec >> 21);
+		ulong_t gib_tenths = ((ATA_LBA_LO(nsec) & 0x1FFFFFUL) * 10UL) >> 21;
 
 		printf("%s: ATA disk, model=\"%s\" %s, (%lu.%u GiB)\n",
 			Cstr(ac), u->model, lba28, gib_i,gib_tenths);
@@ -390,22 +734,24 @@ ata_probe_unit(ata_ctrl_t *ac, u8_t drive)
 			? (u->lbsize==512 ?0:(u->lbsize==1024 ? 1 : 2)) : 0);
 
 	ata_negotiate_pio_multiple(ac,drive);
+	ata_tf_probe(ac,drive);
 
 	return 0;
 }
 
 void
-ata_region_from_dev(dev_t dev, u32_t *out_base, u32_t *out_len)
+ata_region_from_dev(dev_t dev, ata_lba_t *out_base, u32_t *out_len)
 {
 	ata_ctrl_t *ac = &ata_ctrl[ATA_CTRL(dev)];
 	ata_unit_t *u = &ata_unit[ATA_UNIT(dev)];
 	int	part  = ATA_PART(dev);
 	int	slice = ATA_SLICE(dev);
-	u32_t	base=0, len=0, bsz512;
+	ata_lba_t base=0;
+	u32_t	len=0, bsz512;
 	ata_part_t *fp = &u->fd[part];
 
 	ATADEBUG(2,"ata_region_from_dev(%s base=%lu, start=%lu) ABSDEV=%d\n",
-		Dstr(dev), (u32_t)fp->base_lba, 
+		Dstr(dev), ATA_LBA_LO(fp->base_lba), 
 		(u32_t)fp->slice[slice].p_start,
 		ISABSDEV(dev));
 
@@ -415,8 +761,10 @@ ata_region_from_dev(dev_t dev, u32_t *out_base, u32_t *out_len)
         	len  = u->atapi_blocks * bsz512;
 	} else {
 		if (ISABSDEV(dev)) {
+			/* b_blkno is 32-bit: the rest is reached by partition */
 			base = 0;
-			len  = u->nsectors;
+			len  = ATA_LBA_HI(u->nsectors) ? 0xFFFFFFFFUL 
+						       : ATA_LBA_LO(u->nsectors);
 		} else {
 			base = fp->base_lba;
 			len  = fp->nsectors;
@@ -431,7 +779,8 @@ ata_region_from_dev(dev_t dev, u32_t *out_base, u32_t *out_len)
 		}
 	}
 	ATADEBUG(1,"region_from_dev: %s part_base=%lu slice_start=%lu final_base=%lu\n",
-		Dstr(dev),fp->base_lba,fp->slice[slice].p_start,base);
+		Dstr(dev),ATA_LBA_LO(fp->base_lba),fp->slice[slice].p_start,
+		ATA_LBA_LO(base));
 
 	*out_base = base;
 	*out_len  = len;
@@ -451,7 +800,8 @@ ata_pdinfo(dev_t dev)
 	struct ipart *ip;
 	struct buf *bp;
 	ata_part_t *fp;
-	int	i, s, rc;
+	u32_t	ext;
+	int	i, n, s, rc;
 
 	ATADEBUG(1,"ata_pdinfo(%s, dev=%x) drive=%d part=%d\n",	
 		Dstr(dev),dev,drive,part);
@@ -466,6 +816,11 @@ ata_pdinfo(dev_t dev)
 		return EIO;
 	}
 
+	/* Rebuild the cached tables from scratch */
+	bzero((caddr_t)&u->fd[0],sizeof(u->fd));
+	u->gpt_valid = 0;
+	u->nebr = 0;
+
 	if (mboot->signature != MBB_MAGIC) {
 		kmem_free((caddr_t)mboot, DEV_BSIZE);
 		fp = &u->fd[ part ];
@@ -473,80 +828,829 @@ ata_pdinfo(dev_t dev)
 			part,fp->nsectors);
 		fp->slice[ATA_WHOLE_PART_SLICE].p_start = 0;
 		fp->slice[ATA_WHOLE_PART_SLICE].p_size  = fp->nsectors;
+		u->fdisk_valid = 1;
 		return 0;
 	}
 
-	/*** Now copy the others in sequence ***/
+	/* A protective entry: the partitions are in the GPT */
 	ip = (struct ipart *)&mboot->parts;
-	for(i=0; i<FD_NUMPART; ip++) {
-		fp = &u->fd[ i ];
+	for (i = 0; i < FD_NUMPART; i++)
+		if (ip[i].systid == EFI_PMBR) break;
+	if (i < FD_NUMPART && ata_read_gpt(dev, (caddr_t)mboot) == 0) {
+		kmem_free((caddr_t)mboot,DEV_BSIZE);
+		u->fdisk_valid = 1;
+		ata_check_align(ac,u);
+		return 0;
+	}
+
+	/*** Now copy the non-empty entries in sequence ***/
+	ext = 0;
+	for(i=0, n=0; i<FD_NUMPART; i++, ip++) {
 		if (ip->systid == EMPTY) continue;
-		CopyTbl(fp,ip);
-		if (ip->systid == UNIXOS) {
-			fp->slice[ATA_WHOLE_PART_SLICE].p_start = 0;
-			fp->slice[ATA_WHOLE_PART_SLICE].p_size  = fp->nsectors;
-			if (fp->nsectors > 0) {
-				fp->vtoc_valid = ata_read_vtoc(dev, i);
+		if (ISEXTPART(ip->systid) && ext == 0)
+			ext = (u32_t)ip->relsect;
+		CopyTbl(&u->fd[n],ip);
+		ata_setup_part(dev, n);
+		n++;
+	}
+
+	/* Logical partitions follow the primaries */
+	if (ext) 
+		n = ata_walk_ebr(dev, ext, n, (caddr_t)mboot);
+
+	kmem_free((caddr_t)mboot,DEV_BSIZE);
+	u->fdisk_valid = 1;
+	ata_check_align(ac,u);
+	return 0;
+}
+
+/*
+ * fd[n] was just filled in: give a UNIX partition its whole-partition
+ * slice and read its VTOC.
+ */
+void
+ata_setup_part(dev_t dev, int n)
+{
+	ata_part_t *fp = &ata_unit[ATA_UNIT(dev)].fd[n];
+
+	if (fp->systid != UNIXOS) return;
+	fp->slice[ATA_WHOLE_PART_SLICE].p_start = 0;
+	fp->slice[ATA_WHOLE_PART_SLICE].p_size  = fp->nsectors;
+	if (fp->nsectors > 0)
+		fp->vtoc_valid = ata_read_vtoc(dev, n);
+}
+
+/*
+ * Follow the EBR chain of the extended partition at ext, adding each
+ * logical partition from fd[n] on.  An EBR's first entry is relative
+ * to that EBR, its link to the next one relative to ext.  Each EBR
+ * read is noted in ebr_lba[] for ata_meta_overlap().  buf is a
+ * scratch sector.  Returns the new number of fd[] entries.
+ */
+int
+ata_walk_ebr(dev_t dev, u32_t ext, int n, caddr_t buf)
+{
+	ata_unit_t *u = &ata_unit[ATA_UNIT(dev)];
+	struct mboot *mb = (struct mboot *)buf;
+	struct ipart *ip;
+	u32_t	ebr = ext;
+	int	hop;
+
+	for (hop = 0; hop < ATA_EBR_MAXHOP; hop++) {
+		if (ata_kio_rw(ATA_UNIT(dev), 0, (ata_lba_t)ebr, 1, buf) != 0 ||
+		    mb->signature != MBB_MAGIC)
+			break;
+		u->ebr_lba[u->nebr++] = ebr;
+		ip = (struct ipart *)&mb->parts;
+		if (ip[0].systid != EMPTY && ip[0].numsect != 0) {
+			if (n >= ATA_NFDISK) {
+				cmn_err(CE_NOTE,"%s: only %d partitions are addressable",
+					Dstr(dev), ATA_NFDISK);
+				break;
 			}
+			CopyTbl(&u->fd[n],&ip[0]);
+			u->fd[n].base_lba += ebr;
+			ata_setup_part(dev, n);
+			n++;
 		}
-		i++;
+		if (!ISEXTPART(ip[1].systid) || ip[1].relsect == 0)
+			break;
+		ebr = ext + (u32_t)ip[1].relsect;
+	}
+	return n;
+}
+
+/*
+ * CRC-32 (IEEE, reflected) as used by the GPT.
+ */
+u32_t
+ata_crc32(u8_t *p, u32_t len)
+{
+	u32_t	crc = 0xFFFFFFFFUL;
+	int	k;
+
+	while (len--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320UL : 0);
+	}
+	return crc ^ 0xFFFFFFFFUL;
+}
+
+/*
+ * Fill fd[] from the primary GPT.  The header and the entry array
+ * must both pass their CRC; otherwise nothing is taken and the caller
+ * falls back to the MBR.  Entries are used in table order.  buf is a
+ * scratch sector.
+ */
+int
+ata_read_gpt(dev_t dev, caddr_t buf)
+{
+	int	unit = ATA_UNIT(dev);
+	ata_unit_t *u = &ata_unit[unit];
+	ata_gpt_hdr_t *h = (ata_gpt_hdr_t *)buf;
+	ata_gpt_ent_t *e;
+	ata_part_t *fp;
+	ata_lba_t size;
+	u32_t	crc, bytes, nsec, i;
+	caddr_t	ents;
+	int	k, n = 0;
+
+	if (ata_kio_rw(unit, 0, (ata_lba_t)GPT_HDR_LBA, 1, buf) != 0)
+		return EIO;
+	if (h->sig[0] != GPT_SIG_LO || h->sig[1] != GPT_SIG_HI ||
+	    h->hdr_size < GPT_HDR_MINSZ || h->hdr_size > ATA_SECSIZE ||
+	    h->ent_size < GPT_ENT_MINSZ || (h->ent_size & 7) ||
+	    h->nent == 0 || h->nent > GPT_MAXBYTES / h->ent_size)
+		return EINVAL;
+
+	crc = h->hdr_crc;
+	h->hdr_crc = 0;
+	if (ata_crc32((u8_t *)buf, h->hdr_size) != crc) {
+		cmn_err(CE_NOTE,"%s: GPT header CRC mismatch", Dstr(dev));
+		return EINVAL;
+	}
+
+	bytes = h->nent * h->ent_size;
+	nsec  = (bytes + ATA_SECSIZE - 1) >> 9;
+	if (h->ent_lba < 2 || h->ent_lba + nsec > u->nsectors)
+		return EINVAL;
+	ents = (caddr_t)kmem_alloc(nsec << 9, KM_SLEEP);
+	if (!ents) return ENOMEM;
+	if (ata_kio_rw(unit, 0, h->ent_lba, nsec, ents) != 0 ||
+	    ata_crc32((u8_t *)ents, bytes) != h->ent_crc) {
+		kmem_free(ents, nsec << 9);
+		cmn_err(CE_NOTE,"%s: GPT entry array unreadable or bad CRC",
+			Dstr(dev));
+		return EINVAL;
+	}
+
+	for (i = 0; i < h->nent; i++) {
+		e = (ata_gpt_ent_t *)(ents + i * h->ent_size);
+		for (k = 0; k < 16 && e->type[k] == 0; k++)
+			;
+		if (k == 16 || e->last_lba < e->first_lba || 
+		    e->last_lba >= u->nsectors)
+			continue;
+		if (n >= ATA_NFDISK) {
+			cmn_err(CE_NOTE,"%s: only %d GPT partitions are addressable",
+				Dstr(dev), ATA_NFDISK);
+			break;
+		}
+		fp = &u->fd[n++];
+		fp->systid   = EFI_PMBR;
+		fp->base_lba = e->first_lba;
+		size = e->last_lba - e->first_lba + 1;
+		fp->nsectors = ATA_LBA_HI(size) ? 0xFFFFFFFFUL : ATA_LBA_LO(size);
+	}
+
+	u->gpt_first = GPT_HDR_LBA;
+	u->gpt_last  = h->ent_lba + nsec - 1;
+	u->gpt_valid = 1;
+	kmem_free(ents, nsec << 9);
+	ATADEBUG(1,"ata_read_gpt(%s): %d partitions\n", Dstr(dev), n);
+	return 0;
+}
+
+/*
+ * Warn about fdisk partitions and VTOC slices that do not start on a
+ * physical sector of a 512e drive; every write through them pays a
+ * read-modify-write in the drive.
+ */
+void
+ata_check_align(ata_ctrl_t *ac, ata_unit_t *u)
+{
+	ata_part_t *fp;
+	ata_lba_t start;
+	int	i, s;
+
+	if (u->caps.phys_shift == 0) return;
+
+	for (i = 0; i < ATA_NFDISK; i++) {
+		fp = &u->fd[i];
+		if (fp->nsectors == 0) continue;
+		if (ATA_PHYS_OFF(u, fp->base_lba))
+			cmn_err(CE_NOTE,
+			    "%s: drive %d partition %d at %s is not %lu-sector aligned",
+			    Cstr(ac), u->drive, i, Lstr(fp->base_lba), ATA_PHYS_SECS(u));
+		if (fp->systid != UNIXOS || !fp->vtoc_valid) continue;
+		for (s = 1; s < ATA_WHOLE_PART_SLICE; s++) {
+			if (fp->slice[s].p_size == 0) continue;
+			/* As ata_region_from_dev() places it */
+			start = fp->base_lba + fp->slice[s].p_start - 1;
+			if (ATA_PHYS_OFF(u, start))
+				cmn_err(CE_NOTE,
+				    "%s: drive %d partition %d slice %d at %s is not %lu-sector aligned",
+				    Cstr(ac), u->drive, i, s, Lstr(start), ATA_PHYS_SECS(u));
+		}
+	}
+}
+
+/*
+ * Does a write of nsec sectors at absolute lba touch the sectors the
+ * cached partition tables were built from (MBR, GPT, an EBR or a
+ * VTOC sector)?
+ */
+int
+ata_meta_overlap(ata_unit_t *u, ata_lba_t lba, u32_t nsec)
+{
+	ata_lba_t vt;
+	int	i;
+
+	if (nsec == 0) return 0;
+	if (lba == 0) return 1;
+	if (u->gpt_valid && lba <= u->gpt_last && u->gpt_first < lba + nsec)
+		return 1;
+	for (i = 0; i < u->nebr; i++)
+		if (lba <= u->ebr_lba[i] && u->ebr_lba[i] < lba + nsec)
+			return 1;
+	for (i = 0; i < ATA_NFDISK; i++) {
+		if (u->fd[i].systid != UNIXOS || u->fd[i].nsectors == 0)
+			continue;
+		vt = u->fd[i].base_lba + (u32_t)VTOC_SEC;
+		if (lba <= vt && vt < lba + nsec) return 1;
 	}
-	kmem_free((caddr_t)mboot,DEV_BSIZE);
 	return 0;
 }
 
 int 	
 ata_getblock(dev_t dev, daddr_t blkno, caddr_t buf, u32_t count)
 {
-	int	rc;
-	struct buf *bp; 
+	ata_lba_t base;
+	u32_t	len;
 
 	ATADEBUG(1,"ata_getblock(%x,%lu,%x,%lu)\n",dev,blkno,buf,count);
 
-	if (!(bp = geteblk())) return EIO;
+	if (count == 0 || (count & (ATA_SECSIZE-1))) return EINVAL;
+	ata_region_from_dev(dev,&base,&len);
+	if ((u32_t)blkno >= len || (count >> 9) > len - (u32_t)blkno) 
+		return EIO;
+
+	/* Straight into the caller's buffer, no buf or bcopy */
+	return ata_kio_rw(ATA_UNIT(dev), 0, base + (u32_t)blkno, 
+			count >> 9, buf);
+}
+
+int 	
+ata_putblock(dev_t dev, daddr_t blkno, caddr_t buf, u32_t count)
+{
+	ata_lba_t base;
+	u32_t	len;
+	int	rc;
+
+	ATADEBUG(1,"ata_putblock(%x,%lu,%x,%lu)\n",dev,blkno,buf,count);
+
+	if (count == 0 || (count & (ATA_SECSIZE-1))) return EINVAL;
+	ata_region_from_dev(dev,&base,&len);
+	if ((u32_t)blkno >= len || (count >> 9) > len - (u32_t)blkno) 
+		return EIO;
+
+	rc = ata_kio_rw(ATA_UNIT(dev), ATA_KIO_WRITE, base + (u32_t)blkno, 
+			count >> 9, buf);
+
+	/* As bok() does for whole-disk writes */
+	if (rc == 0 && ISABSDEV(dev)) {
+		bflush(dev);
+		ata_flush_cache(&ata_ctrl[ATA_CTRL(dev)], ATA_DRIVE(dev));
+	}
+	return rc ? EIO : 0;
+}
+
+/*
+ * One merged request of an ata_batch() call: segments ord[first ..
+ * first+n-1] covering sectors lba .. lba+nsec-1 back to back.
+ */
+struct ata_brun {
+	int	first, n;
+	u32_t	lba, nsec;
+	caddr_t	kbuf;
+	struct buf *bp;
+};
+
+/*
+ * Vectored raw I/O for ATAIOC_BATCH and V_RDABS/V_WRABS.  seg[] is in
+ * kernel space, its buffers in user space; lba is relative to dev's
+ * region.  Valid segments are sorted by lba, contiguous ones merged
+ * into single requests, and every request queued before waiting on
+ * any, so the channel runs them back to back in ascending order.
+ * Per-segment status is left in seg[].status and the failure count
+ * in *nfail; the return value is for the call as a whole.  The
+ * requests count against odev, the minor the caller opened.
+ */
+int
+ata_batch(dev_t dev, dev_t odev, ata_seg_t *seg, int nseg, int is_write,
+	  int *nfail)
+{
+	ata_ctrl_t *ac = &ata_ctrl[ATA_CTRL(dev)];
+	struct ata_brun *run;
+	struct buf *bp;
+	ata_req_t *r;
+	ata_seg_t *sp;
+	ata_lba_t base;
+	u32_t	len, total = 0, off;
+	int	*ord, i, j, k, nv = 0, nrun = 0, err;
+
+	*nfail = 0;
+	ata_region_from_dev(dev, &base, &len);
+
+	ord = (int *)kmem_alloc(nseg * sizeof(int), KM_SLEEP);
+	if (!ord) return ENOMEM;
+
+	/* Validate, and insertion-sort the good ones by lba (stable) */
+	for (i = 0; i < nseg; i++) {
+		sp = &seg[i];
+		sp->status = 0;
+		if (sp->nsec == 0 || sp->nsec > ATA_BATCH_MAXRUN ||
+		    sp->lba >= len || sp->nsec > len - sp->lba ||
+		    sp->buf == NULL) {
+			sp->status = EINVAL;
+			continue;
+		}
+		total += sp->nsec;
+		for (j = nv; j > 0 && seg[ord[j-1]].lba > sp->lba; j--)
+			ord[j] = ord[j-1];
+		ord[j] = i;
+		nv++;
+	}
+	if (total > ATA_BATCH_MAXSEC) {
+		kmem_free((caddr_t)ord, nseg * sizeof(int));
+		return E2BIG;
+	}
+
+	run = (struct ata_brun *)kmem_zalloc((nv ? nv : 1) * sizeof(*run), KM_SLEEP);
+	if (!run) {
+		kmem_free((caddr_t)ord, nseg * sizeof(int));
+		return ENOMEM;
+	}
+
+	/* Merge neighbours that continue exactly where the run ends */
+	for (i = 0; i < nv; i++) {
+		sp = &seg[ord[i]];
+		if (nrun > 0 &&
+		    run[nrun-1].lba + run[nrun-1].nsec == sp->lba &&
+		    run[nrun-1].nsec + sp->nsec <= ATA_BATCH_MAXRUN) {
+			run[nrun-1].n++;
+			run[nrun-1].nsec += sp->nsec;
+			continue;
+		}
+		run[nrun].first = i;
+		run[nrun].n     = 1;
+		run[nrun].lba   = sp->lba;
+		run[nrun].nsec  = sp->nsec;
+		nrun++;
+	}
+
+	ATADEBUG(2,"ata_batch(%s) %s nseg=%d valid=%d runs=%d sectors=%lu\n",
+		Dstr(dev), is_write ? "WRITE" : "READ", nseg, nv, nrun, total);
+
+	/* Stage write data and queue every run; nothing waits yet */
+	for (k = 0; k < nrun; k++) {
+		run[k].kbuf = (caddr_t)kmem_alloc(run[k].nsec << 9, KM_SLEEP);
+		if (!run[k].kbuf) continue;
+		err = 0;
+		for (i = run[k].first; is_write && i < run[k].first + run[k].n; i++) {
+			sp = &seg[ord[i]];
+			off = (sp->lba - run[k].lba) << 9;
+			if (copyin(sp->buf, run[k].kbuf + off, sp->nsec << 9) != 0)
+				err = EFAULT;
+		}
+		if (err) continue;
+
+		bp = getrbuf(KM_SLEEP);
+		if (!bp) continue;
+		bp->b_dev    = dev;
+		bp->b_edev   = dev;
+		bp->b_error  = 0;
+		bp->b_resid  = 0;
+		bp->b_flags  = B_BUSY | (is_write ? B_WRITE : B_READ);
+		bp->b_blkno  = (daddr_t)run[k].lba;
+		bp->b_bcount = run[k].nsec << 9;
+		bp->b_un.b_addr = run[k].kbuf;
+		run[k].bp = bp;
+
+		if ((r = ata_mkreq(bp, odev)) != NULL)
+			ata_queuereq(ac, r);
+	}
+
+	/* Reap in order and hand each segment its share */
+	for (k = 0; k < nrun; k++) {
+		bp = run[k].bp;
+		if (!run[k].kbuf) {
+			err = ENOMEM;
+		} else if (!bp) {
+			err = is_write ? EFAULT : ENOMEM;
+		} else {
+			iowait(bp);
+			err = (bp->b_flags & B_ERROR) ? 
+				(bp->b_error ? bp->b_error : EIO) : 0;
+		}
+		for (i = run[k].first; i < run[k].first + run[k].n; i++) {
+			sp = &seg[ord[i]];
+			sp->status = err;
+			if (err || is_write) continue;
+			off = (sp->lba - run[k].lba) << 9;
+			if (copyout(run[k].kbuf + off, sp->buf, sp->nsec << 9) != 0)
+				sp->status = EFAULT;
+		}
+		if (bp) freerbuf(bp);
+		if (run[k].kbuf) kmem_free(run[k].kbuf, run[k].nsec << 9);
+	}
+
+	for (i = 0; i < nseg; i++)
+		if (seg[i].status) (*nfail)++;
+
+	kmem_free((caddr_t)run, (nv ? nv : 1) * sizeof(*run));
+	kmem_free((caddr_t)ord, nseg * sizeof(int));
+	return 0;
+}
+
+/*
+ * ATAIOC_SUBMIT: stage and queue one request, return without waiting.
+ */
+int
+ata_aio_submit(dev_t dev, ata_aio_t *ap)
+{
+	ata_ctrl_t *ac = &ata_ctrl[ATA_CTRL(dev)];
+	ata_unit_t *u  = ac->drive[ATA_DRIVE(dev)];
+	ata_aioslot_t *sl = NULL;
+	struct buf *bp;
+	ata_req_t *r;
+	ata_lba_t base;
+	u32_t	len;
+	int	i, s;
+
+	ata_region_from_dev(dev, &base, &len);
+	if (ap->nsec == 0 || ap->nsec > ATA_AIO_MAXSEC || ap->buf == NULL ||
+	    ap->lba >= len || ap->nsec > len - ap->lba)
+		return EINVAL;
+
+	s = splbio();
+	for (i = 0; i < ATA_AIO_MAX; i++) {
+		if (u->aio[i].state == ATA_AIO_FREE) {
+			sl = &u->aio[i];
+			sl->state = ATA_AIO_QUEUED;
+			u->aio_nout++;
+			break;
+		}
+	}
+	splx(s);
+	if (!sl) return EAGAIN;
+
+	(void)drv_getparm(UPROCP, (ulong_t *)&sl->owner);
+	sl->dev  = dev;
+	sl->is_write = (ap->flags & ATA_AIO_WRITE) != 0;
+	sl->tag  = ap->tag;
+	sl->ubuf = ap->buf;
+	sl->len  = ap->nsec << 9;
+	sl->kbuf = (caddr_t)kmem_alloc(sl->len, KM_SLEEP);
+	sl->bp   = getrbuf(KM_SLEEP);
+	if (!sl->kbuf || !sl->bp ||
+	    (sl->is_write && copyin(sl->ubuf, sl->kbuf, sl->len) != 0)) {
+		i = (sl->kbuf && sl->bp) ? EFAULT : ENOMEM;
+		ata_aio_release(u, sl);
+		return i;
+	}
 
+	bp = sl->bp;
 	bp->b_dev    = dev;
 	bp->b_edev   = dev;
 	bp->b_error  = 0;
 	bp->b_resid  = 0;
-	bp->b_flags  = B_READ | B_BUSY;
-	bp->b_blkno  = blkno;
-	bp->b_bcount = count;
+	bp->b_flags  = B_BUSY | B_CALL | (sl->is_write ? B_WRITE : B_READ);
+	bp->b_iodone = ata_aio_done;
+	bp->b_blkno  = (daddr_t)ap->lba;
+	bp->b_bcount = sl->len;
+	bp->b_un.b_addr = sl->kbuf;
+
+	if ((r = ata_mkreq(bp, dev)) != NULL)
+		ata_queuereq(ac, r);
+	return 0;
+}
+
+/*
+ * b_iodone for ATAIOC_SUBMIT bufs, called from biodone() at interrupt
+ * level: move the slot onto the unit's completion ring.
+ */
+void
+ata_aio_done(struct buf *bp)
+{
+	ata_unit_t *u = &ata_unit[ATA_UNIT(bp->b_edev)];
+	int	i, s;
+
+	s = splbio();
+	for (i = 0; i < ATA_AIO_MAX; i++) {
+		if (u->aio[i].bp == bp && u->aio[i].state == ATA_AIO_QUEUED) {
+			u->aio[i].state = ATA_AIO_DONE;
+			u->aio_ring[(u->aio_rhead + u->aio_rcnt) % ATA_AIO_MAX] = (u8_t)i;
+			u->aio_rcnt++;
+			break;
+		}
+	}
+	splx(s);
+	wakeup((caddr_t)u->aio_ring);
+}
+
+/*
+ * Free a slot's resources and return it to the unit.
+ */
+void
+ata_aio_release(ata_unit_t *u, ata_aioslot_t *sl)
+{
+	int	s;
+
+	if (sl->bp) freerbuf(sl->bp);
+	if (sl->kbuf) kmem_free(sl->kbuf, sl->len);
+	sl->bp   = NULL;
+	sl->kbuf = NULL;
+	s = splbio();
+	sl->state = ATA_AIO_FREE;
+	u->aio_nout--;
+	splx(s);
+}
+
+/*
+ * ATAIOC_REAP: wait for min completions, then return up to max of
+ * them, copying read data out to the caller's buffers.  Only slots
+ * this process submitted through this minor are seen; the ring keeps
+ * everyone else's in order.
+ */
+int
+ata_aio_reap(dev_t dev, ata_reap_t *rp, ata_aiodone_t *done)
+{
+	ata_unit_t *u = &ata_unit[ATA_UNIT(dev)];
+	ata_aioslot_t *sl;
+	struct buf *bp;
+	caddr_t	me;
+	int	s, want, got, k, j;
+
+	want = rp->min;
+	if (want > rp->max) want = rp->max;
+	(void)drv_getparm(UPROCP, (ulong_t *)&me);
+
+	s = splbio();
+	while ((got = ata_aio_mine(u, me, dev, ATA_AIO_DONE)) < want) {
+		/* Nothing queued can never satisfy the wait */
+		if (got + ata_aio_mine(u, me, dev, ATA_AIO_QUEUED) < want)
+			break;
+		sleep((caddr_t)u->aio_ring, PRIBIO);
+	}
+
+	rp->n = 0;
+	for (k = 0; k < u->aio_rcnt && rp->n < rp->max; ) {
+		sl = &u->aio[u->aio_ring[(u->aio_rhead + k) % ATA_AIO_MAX]];
+		if (sl->owner != me || sl->dev != dev) {
+			k++;
+			continue;
+		}
+		for (j = k; j + 1 < u->aio_rcnt; j++)
+			u->aio_ring[(u->aio_rhead + j) % ATA_AIO_MAX] =
+			    u->aio_ring[(u->aio_rhead + j + 1) % ATA_AIO_MAX];
+		u->aio_rcnt--;
+		splx(s);
+
+		bp = sl->bp;
+		done[rp->n].tag    = sl->tag;
+		done[rp->n].resid  = bp->b_resid;
+		done[rp->n].status = (bp->b_flags & B_ERROR) ? 
+				(bp->b_error ? bp->b_error : EIO) : 0;
+		if (!sl->is_write && !done[rp->n].status &&
+		    copyout(sl->kbuf, sl->ubuf, sl->len - bp->b_resid) != 0)
+			done[rp->n].status = EFAULT;
+		rp->n++;
+		ata_aio_release(u, sl);
+		s = splbio();
+		k = 0;		/* the ring may have moved meanwhile */
+	}
+	splx(s);
+	return 0;
+}
+
+int
+ata_aio_queued(ata_unit_t *u)
+{
+	int	i, n = 0;
 
-	atastrategy(bp);
-	iowait(bp);
+	for (i = 0; i < ATA_AIO_MAX; i++)
+		if (u->aio[i].state == ATA_AIO_QUEUED) n++;
+	return n;
+}
 
-	rc = (bp->b_flags & B_ERROR) ? EIO : 0;
-	bcopy(bp->b_un.b_addr,buf,count);
-	brelse(bp);
+/*
+ * Slots in state that the process me submitted through dev.
+ */
+int
+ata_aio_mine(ata_unit_t *u, caddr_t me, dev_t dev, int state)
+{
+	int	i, n = 0;
+
+	for (i = 0; i < ATA_AIO_MAX; i++)
+		if (u->aio[i].state == state && u->aio[i].owner == me &&
+		    u->aio[i].dev == dev)
+			n++;
+	return n;
+}
 
+/*
+ * Last close of minor dev, so every process that submitted through it
+ * has closed it: wait for its slots still in flight, then drop the
+ * ones never reaped and take them off the ring.  Slots of other
+ * minors keep their place.
+ */
+void
+ata_aio_flush(ata_unit_t *u, dev_t dev)
+{
+	ata_aioslot_t *sl;
+	int	i, k, n, s;
+
+	s = splbio();
+	for (;;) {
+		for (i = 0; i < ATA_AIO_MAX; i++)
+			if (u->aio[i].state == ATA_AIO_QUEUED &&
+			    u->aio[i].dev == dev)
+				break;
+		if (i == ATA_AIO_MAX) break;
+		sleep((caddr_t)u->aio_ring, PRIBIO);
+	}
+
+	/* Every finished slot is on the ring: release dev's in passing */
+	for (k = n = 0; k < u->aio_rcnt; k++) {
+		i  = u->aio_ring[(u->aio_rhead + k) % ATA_AIO_MAX];
+		sl = &u->aio[i];
+		if (sl->dev == dev) {
+			ata_aio_release(u, sl);
+			continue;
+		}
+		u->aio_ring[(u->aio_rhead + n++) % ATA_AIO_MAX] = (u8_t)i;
+	}
+	u->aio_rcnt = n;
+	if (n == 0) u->aio_rhead = 0;
+	splx(s);
+}
+
+/*
+ * Check lba .. lba+nsec-1 (absolute) with READ VERIFY.  Each failure
+ * is recorded in bad[], as an offset from lba, and the scan resumes on
+ * the next sector, until the range is done or bad[] is full.  *done is
+ * the number of sectors covered.
+ */
+int
+ata_verify_range(int unit, ata_lba_t lba, u32_t nsec, u32_t *bad, int maxbad,
+		 int *nbad, u32_t *done)
+{
+	ata_kio_t kio;
+	ata_lba_t cur = lba, end = lba + nsec;
+	int	rc = 0;
+
+	*nbad = 0;
+	while (cur < end) {
+		bzero((caddr_t)&kio, sizeof(kio));
+		kio.unit  = unit;
+		kio.flags = ATA_KIO_VERIFY;
+		kio.lba   = cur;
+		kio.nsec  = (end - cur > ATA_KIO_MAXSEC) ? ATA_KIO_MAXSEC
+							 : (u32_t)(end - cur);
+		if ((rc = ata_kio_submit(&kio)) != 0) break;
+		if ((rc = ata_kio_wait(&kio)) == 0) {
+			cur += kio.nsec;
+			continue;
+		}
+		if (rc != EIO || *nbad >= maxbad) break;
+
+		ATADEBUG(1,"ata_verify_range(unit=%d): bad lba %s\n",
+			unit, Lstr(kio.err_lba));
+		bad[(*nbad)++] = (u32_t)(kio.err_lba - lba);
+		cur = kio.err_lba + 1;
+		rc = 0;
+		if (*nbad >= maxbad) break;
+	}
+	*done = (u32_t)(cur - lba);
 	return rc;
 }
 
-int 	
-ata_putblock(dev_t dev, daddr_t blkno, caddr_t buf, u32_t count)
+/*
+ * Zero lba .. lba+nsec-1 (absolute), streaming from ata_zero_sec in
+ * the largest commands the unit takes, ATA_KIO_MAXSEC per kio.
+ */
+int
+ata_zero_range(int unit, ata_lba_t lba, u32_t nsec)
 {
-	int rc;
-	struct buf *bp; 
+	ata_kio_t kio;
+	int	rc = 0;
+
+	ATADEBUG(1,"ata_zero_range(unit=%d lba=%s nsec=%lu)\n",
+		unit,Lstr(lba),nsec);
+
+	while (nsec > 0 && rc == 0) {
+		bzero((caddr_t)&kio, sizeof(kio));
+		kio.unit  = unit;
+		kio.flags = ATA_KIO_ZERO;
+		kio.lba   = lba;
+		kio.nsec  = (nsec > ATA_KIO_MAXSEC) ? ATA_KIO_MAXSEC : nsec;
+		if ((rc = ata_kio_submit(&kio)) == 0)
+			rc = ata_kio_wait(&kio);
+		lba  += kio.nsec;
+		nsec -= kio.nsec;
+	}
+	return rc;
+}
 
-	ATADEBUG(1,"ata_putblock(%x,%lu,%x,%lu)\n",dev,blkno,buf,count);
+/*
+ * Set kp up for chunk ci of an ata_copy_range() of nsec sectors: unit
+ * un from sector base, in copy buffer ci % ATA_COPY_NBUF.
+ */
+static void
+ata_copy_chunk(ata_kio_t *kp, int un, ata_lba_t base, u32_t ci, u32_t nsec,
+	       int fl, caddr_t *buf)
+{
+	u32_t	off = ci * ATA_COPY_BUFSEC,
+		n   = nsec - off;
+
+	if (n > ATA_COPY_BUFSEC) n = ATA_COPY_BUFSEC;
+	bzero((caddr_t)kp, sizeof(*kp));
+	kp->unit  = un;
+	kp->flags = fl;
+	kp->lba   = base + off;
+	kp->nsec  = n;
+	kp->addr  = buf[ci % ATA_COPY_NBUF];
+}
 
-	if (!(bp = geteblk())) return EIO;
+/*
+ * Copy nsec sectors from unit su at slba to unit du at dlba (absolute).
+ * Chunk i lives in buffer i % ATA_COPY_NBUF: once it has been read its
+ * write is queued, then the previous chunk's write is reaped and its
+ * buffer refilled with the read ATA_COPY_NBUF-1 chunks ahead.  Writes
+ * trail reads, so a same-unit copy to a lower address is safe; the
+ * caller rejects overlapping copies to a higher one.
+ */
+int
+ata_copy_range(int su, ata_lba_t slba, int du, ata_lba_t dlba, u32_t nsec, 
+	       u32_t *done)
+{
+	ata_kio_t *rd, *wr;
+	caddr_t	buf[ATA_COPY_NBUF];
+	int	pend_rd[ATA_COPY_NBUF], pend_wr[ATA_COPY_NBUF];
+	u32_t	nchunk, i, j;
+	int	k, rc = 0, e;
+
+	*done  = 0;
+	nchunk = (nsec + ATA_COPY_BUFSEC - 1) / ATA_COPY_BUFSEC;
+
+	rd = (ata_kio_t *)kmem_zalloc(2 * ATA_COPY_NBUF * sizeof(ata_kio_t), KM_SLEEP);
+	if (!rd) return ENOMEM;
+	wr = rd + ATA_COPY_NBUF;
+	for (k = 0; k < ATA_COPY_NBUF; k++) {
+		pend_rd[k] = pend_wr[k] = 0;
+		buf[k] = (caddr_t)kmem_alloc(ATA_COPY_BUFSEC << 9, KM_SLEEP);
+		if (!buf[k]) rc = ENOMEM;
+	}
 
-	bp->b_dev    = dev;
-	bp->b_edev   = dev;
-	bp->b_error  = 0;
-	bp->b_resid  = 0;
-	bp->b_flags  = B_WRITE | B_BUSY;
-	bp->b_blkno  = blkno;
-	bp->b_bcount = count;
+	/* Prime the read-ahead */
+	for (i = 0; rc == 0 && i < nchunk && i < ATA_COPY_NBUF; i++) {
+		ata_copy_chunk(&rd[i], su, slba, i, nsec, 0, buf);
+		if ((rc = ata_kio_submit(&rd[i])) == 0) pend_rd[i] = 1;
+	}
+
+	for (i = 0; rc == 0 && i < nchunk; i++) {
+		k = i % ATA_COPY_NBUF;
+
+		pend_rd[k] = 0;
+		if ((rc = ata_kio_wait(&rd[k])) != 0) break;
 
-	bcopy(buf, bp->b_un.b_addr, count);
-	atastrategy(bp);
-	iowait(bp);
+		ata_copy_chunk(&wr[k], du, dlba, i, nsec, ATA_KIO_WRITE, buf);
+		if ((rc = ata_kio_submit(&wr[k])) != 0) break;
+		pend_wr[k] = 1;
 
-	rc = (bp->b_flags & B_ERROR) ? EIO : 0;
-	brelse(bp);
+		if (i == 0) continue;
+		k = (i - 1) % ATA_COPY_NBUF;
+		pend_wr[k] = 0;
+		if ((rc = ata_kio_wait(&wr[k])) != 0) break;
+		*done += wr[k].nsec;
+
+		j = i - 1 + ATA_COPY_NBUF;
+		if (j < nchunk) {
+			ata_copy_chunk(&rd[k], su, slba, j, nsec, 0, buf);
+			if ((rc = ata_kio_submit(&rd[k])) != 0) break;
+			pend_rd[k] = 1;
+		}
+	}
+
+	/* Reap whatever is still in flight before the buffers go */
+	for (k = 0; k < ATA_COPY_NBUF; k++) {
+		if (pend_rd[k])
+			(void)ata_kio_wait(&rd[k]);
+		if (pend_wr[k]) {
+			e = ata_kio_wait(&wr[k]);
+			if (e == 0) *done += wr[k].nsec;
+			else if (rc == 0) rc = e;
+		}
+	}
+
+	for (k = 0; k < ATA_COPY_NBUF; k++)
+		if (buf[k]) kmem_free(buf[k], ATA_COPY_BUFSEC << 9);
+	kmem_free((caddr_t)rd, 2 * ATA_COPY_NBUF * sizeof(ata_kio_t));
+
+	ATADEBUG(1,"ata_copy_range(%d:%lu -> %d:%lu, %lu) done=%lu rc=%d\n",
+		su, ATA_LBA_LO(slba), du, ATA_LBA_LO(dlba), nsec, *done, rc);
 	return rc;
 }
 
@@ -581,14 +1685,22 @@ bok(struct buf *bp, int resid)
 	return 0;
 }
 
+/*
+ * POLL mode: drive the command engine from ALTSTATUS instead of the
+ * interrupt.  Gives up the CPU after ATA_POLL_BURST DRQ blocks or when
+ * the drive has kept it waiting ATA_POLL_SPIN_US; the watchdog, armed
+ * for the next tick, picks the request up again.
+ */
 void
 ide_poll_engine(ata_ctrl_t *ac)
 {
 	ata_ioque_t *q;
 	ata_req_t   *r;
+	ata_state_t prev;
+	u32_t	left;
 	u8_t	ast;
-	int		poll_burst;
-	int		burst_done;
+	long	spin = 0;
+	int	blocks = 0;
 
 	q = ac ? ac->ioque : 0;
 	r = q ? q->cur : 0;
@@ -602,122 +1714,34 @@ ide_poll_engine(ata_ctrl_t *ac)
 
 	AC_SET_FLAG(ac, ACF_POLL_RUNNING);
 
-	/* Max number of sectors to service per poll entry (avoid watchdog-only progress) */
-	poll_burst = 32;
-	burst_done = 0;
-
-	/* Drive the state machine until we either need to yield or finish */
-	for (;;) {
-		/* Tiny yield to avoid a hot loop if the device is still busy */
-		drv_usecwait(2);
+	/* Follows q->cur: a completion issues the next request */
+	while ((r = q->cur) != NULL && spin < ATA_POLL_SPIN_US && 
+	       blocks < ATA_POLL_BURST) {
+		prev = q->state;
+		left = r->sectors_left;
 
-		ata_err(ac, &ast, 0);
+		ast = inb(ATA_ALTSTATUS_O(ac));
 		ATADEBUG(5, "poll: ST=%02x\n", ast);
+		ata_sm_step(ac, r, ast, ATA_EV_POLL);
 
-		if (ast & ATA_SR_BSY)
+		if (q->cur != r) {
+			blocks++;
+			spin = 0;
 			continue;
-
-		if (ast & ATA_SR_ERR) {
-			ata_finish_current(ac, EIO, __LINE__);
-			ide_kick(ac);
-			break;
 		}
-
-		if (ast & ATA_SR_DRQ) {
-			/* Progress: reset DRQ wait budget */
-			r->await_drq_ticks = HZ * 2;
-
-			if (ata_data_phase_service(ac, r) < 0) {
-				ata_finish_current(ac, EIO, __LINE__);
-				ide_kick(ac);
-				break;
-			}
-
-			/* Count one sector serviced */
-			burst_done++;
-
-			/*
-			 * If we have finished the programmed block (chunk_left == 0),
-			 * handle end-of-chunk bookkeeping now (DRQ may remain asserted
-			 * until status settles). Do not yield early on burst budget in
-			 * this case, or we can leave the device in a DRQ state and trip
-			 * the DRQ-clear check later.
-			 */
-			if (r->chunk_left == 0) {
-				/* End of programmed block: require BSY|DRQ to drop before next cmd */
-				{
-					u8_t st2, er2;
-					if (ata_wait(ac, 0, (ATA_SR_BSY|ATA_SR_DRQ), 50000, &st2, &er2) != 0) {
-						cmn_err(CE_WARN, "%s: DRQ did not clear after data phase (st=%02x err=%02x)",
-							Cstr(ac), st2, er2);
-						ata_finish_current(ac, EIO, __LINE__);
-						ide_kick(ac);
-						break;
-					}
-				}
-
-				if (r->sectors_left > 0) {
-					ata_program_next_chunk(ac, r, HZ/8);
-				} else {
-					ata_finish_current(ac, 0, __LINE__);
-					ide_kick(ac);
-					break;
-				}
-				continue;
-			}
-
-			/* Still inside this programmed block; yield after a burst */
-			if (burst_done >= poll_burst)
-				break;
-
-			/* PIO MULTIPLE: keep servicing while chunk_left > 0 */
+		if (q->state != prev || r->sectors_left != left) {
+			if (r->sectors_left != left) blocks++;
+			spin = 0;
 			continue;
 		}
-		/* Inter-sector gap in multi-sector PIO (command still active) */
-		if (r->chunk_left > 0 && r->sectors_left > 0) {
-			if (r->await_drq_ticks > 0) {
-				r->await_drq_ticks--;
-				continue;
-			}
-			cmn_err(CE_WARN,
-			    "%s: POLL DRQ timeout (st=%02x) lba=%lu secleft=%lu chunkleft=%lu",
-			    Cstr(ac), ast, (u32_t)r->lba_cur, (u32_t)r->sectors_left,
-			    (u32_t)r->chunk_left);
-			ata_finish_current(ac, EIO, __LINE__);
-			ide_kick(ac);
-			break;
-		}
-
-		/* Waiting for first DRQ after issuing a command */
-		if (r->sectors_left > 0 && r->chunk_left == 0) {
-			if (r->await_drq_ticks > 0) {
-				r->await_drq_ticks--;
-				continue;
-			}
-			cmn_err(CE_WARN,
-			    "%s: POLL no progress (st=%02x) lba=%lu secleft=%lu",
-			    Cstr(ac), ast, (u32_t)r->lba_cur, (u32_t)r->sectors_left);
-			ata_finish_current(ac, EIO, __LINE__);
-			ide_kick(ac);
-			break;
-		}
-
-		/* Completion edge in POLL mode */
-		if (r->sectors_left == 0 && r->chunk_left == 0) {
-			ata_finish_current(ac, 0, __LINE__);
-			ide_kick(ac);
-			break;
-		}
-
-		/*
-		 * POLL mode needs to emulate the "completion interrupt" edge
-		 * for cases where commands complete with no DRQ/data phase.
-		 */
-		ata_service_irq(ac, r, ast);
-		continue;
+		/* Tiny yield to avoid a hot loop if the device is still busy */
+		drv_usecwait(2);
+		spin += 2;
 	}
+	ata_sm_arm(ac);
 
-	if (AC_HAS_FLAG(ac, ACF_PENDING_KICK) &&
+	/* Only an idle channel is started again, so this nests once */
+	if (AC_HAS_FLAG(ac, ACF_PENDING_KICK) && !q->cur &&
 	    !AC_HAS_FLAG(ac, ACF_INTR_MODE)) {
 		AC_CLR_FLAG(ac, ACF_PENDING_KICK);
 		ide_kick_internal(ac);
@@ -811,6 +1835,9 @@ get_sysid(u8_t systid)
 	case PCIXOS:		return "PCIXOS";
 	case FAT16:		return "FAT16";
 	case EXTDOS:		return "EXTDOS";
+	case EXTWIN:		return "EXTWIN";
+	case EXTLINUX:		return "EXTLINUX";
+	case EFI_PMBR:		return "GPT";
 	case NTFS:		return "NTFS";
 	case DOSDATA:		return "DOSDATA";
 	case OTHEROS:		return "OTHEROS";
@@ -837,10 +1864,10 @@ ata_dump_fdisk(int ctrl, u8_t drive)
 	if (!U_HAS_FLAG(u,UF_PRESENT)) return;
 	if (U_HAS_FLAG(u,UF_ATAPI)) return;
 
-	for(fdisk=0; fdisk<4; fdisk++) {
+	for(fdisk=0; fdisk<ATA_NFDISK; fdisk++) {
 		ata_part_t *fp=&u->fd[fdisk];
 
-		u32_t 	base   = fp->base_lba;
+		ata_lba_t base = fp->base_lba;
 		u32_t 	nsec   = fp->nsectors;
 		int 	valid  = fp->vtoc_valid;
 		u8_t	active = fp->active;
@@ -856,10 +1883,10 @@ ata_dump_fdisk(int ctrl, u8_t drive)
 		if (!any && base == 0 && nsec == 0 && !valid) continue;
 
 		systid = get_sysid(u->fd[fdisk].systid);
-		printf(" %cPart=%d: Type=%-10s base_lba=%lu size=%lu %s\n",
+		printf(" %cPart=%d: Type=%-10s base_lba=%s size=%lu %s\n",
 			active ? '+' : ' ',
 			fdisk, systid,
-			(ulong_t)base, (ulong_t)nsec,
+			Lstr(base), (ulong_t)nsec,
 			valid ? "vtoc=VALID" : "");
 
 		for(s=0;s<ATA_NPART; s++) {
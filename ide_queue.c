@@ -37,92 +37,57 @@ ide_watchdog(caddr_t arg)
 	ata_ctrl_t *ac = (ata_ctrl_t *)arg;
 	ata_ioque_t *q = ac ? ac->ioque : NULL;
 	ata_req_t   *r = q ? q->cur : NULL;
-	int	s, er, progress=0;
-	u8_t 	ast, err;
-
-	ATADEBUG(3,"ide_watchdog(r=%08x chunk_left=%x sectors_left=%x)\n",
-		r, r ? r->chunk_left : -1, r ? r->sectors_left : -1);
+	int	s;
+	u8_t 	ast;
 
-	if (q && q->cur == NULL) 
-		printf("WARNING: q->cur while command still active\n");
+	ATADEBUG(3,"ide_watchdog(r=%08x state=%d chunk_left=%x sectors_left=%x)\n",
+		r, q ? q->state : -1, r ? r->chunk_left : -1, 
+		r ? r->sectors_left : -1);
 
-	if (!r) { 
-		ac->tmo_id=0; 
-		return; 
-	}
+	ac->tmo_id = 0;
+	if (!r) return;
 
 	BUMP(ac,wd_fired);
 
-	er = ata_err(ac,&ast,&err); 	/*** Check for Error ***/
-
-	if (r->prev_chunk_left != r->chunk_left ||
-	    r->prev_sectors_left != r->sectors_left) {
-		r->wdog_stuck=0;
-		r->prev_chunk_left = r->chunk_left;
-		r->prev_sectors_left = r->sectors_left;
-		progress=1;
+	/* A tick is one more event for the command engine */
+	if (!AC_HAS_FLAG(ac, ACF_INTR_MODE)) {
+		ide_poll_engine(ac);
 	} else {
-		r->wdog_stuck++;
+		s = splbio();
+		ata_sm_run(ac, r, inb(ATA_ALTSTATUS_O(ac)), ATA_EV_TICK);
+		splx(s);
 	}
 
+	s = splbio();
+	if (q->cur != r) { 
+		splx(s); 
+		return; 
+	}
 
-/*
- * If the device is not busy and not reporting ERR, but is still
- * asserting DRQ with no forward progress, we can wedge forever
- * waiting for a completion interrupt that will never come.
- * Proactively recover from this "DRQ stuck" state.
- */
-if (r->wdog_stuck > 5 &&
-    !(ast & ATA_SR_BSY) &&
-    (ast & ATA_SR_DRQ) &&
-    !(ast & (ATA_SR_ERR|ATA_SR_DWF)) &&
-    err == 0) {
-	printf("ide_watchdog: DRQ stuck (lba=%ld) ST=%02x ERR=%02x\n",
-		r->lba_cur, ast, err);
-	ata_softreset_ctrl(ac);
-	ata_rescueit(ac);
-	return;
-}
-
-	if (r->wdog_stuck > 50) {
-		printf("ide_watchdog: timeout waiting for completion (lba=%ld) ST=%02x ERR=%02x\n", r->lba_cur,ast,err);
+	if (r->prev_state != q->state ||
+	    r->prev_chunk_left != r->chunk_left ||
+	    r->prev_sectors_left != r->sectors_left) {
+		BUMP(ac,wd_serviced);
+		r->prev_state = q->state;
+		r->prev_chunk_left = r->chunk_left;
+		r->prev_sectors_left = r->sectors_left;
+		r->wd_progress = lbolt;
+	} else if ((u32_t)(lbolt - r->wd_progress) > (u32_t)ATA_WD_STALL) {
+		ast = inb(ATA_ALTSTATUS_O(ac));
+		printf("ide_watchdog: %s stalled in state %d (lba=%ld) ST=%02x\n",
+			Cstr(ac), q->state, ATA_LBA_LO(r->lba_cur), ast);
+		/* A drive still holding BSY or DRQ will not take the next command */
+		if (ast & (ATA_SR_BSY|ATA_SR_DRQ)) {
+			BUMP(ac,wd_resets);
+			ata_softreset_ctrl(ac);
+		}
+		splx(s);
 		ata_rescueit(ac);
 		return;
 	}
 
-
-s=splbio();
-if (r->chunk_left > 0 && r->sectors_left > 0) {
-	BUMP(ac,wd_serviced);
-	splx(s);
-	/* In POLL mode, keep driving the state machine from the watchdog. */
-	if (!AC_HAS_FLAG(ac, ACF_INTR_MODE)) {
-		ide_poll_engine(ac);
-		if (q->cur == NULL) return;
-	}
-	ide_arm_watchdog(ac,HZ/10);
-	return;	
-}
-if (r->chunk_left == 0 && r->sectors_left > 0) {
-	BUMP(ac,wd_rekicked);
-	ata_program_next_chunk(ac, r, HZ/8);
-	splx(s);
-	if (!AC_HAS_FLAG(ac, ACF_INTR_MODE)) {
-		ide_poll_engine(ac);
-		if (q->cur == NULL) return;
-	}
-	ide_arm_watchdog(ac,HZ/10);
-	return;
-}
-if (r->chunk_left == 0 && r->sectors_left == 0) {
-	BUMP(ac,eoc_polled);
-	ata_finish_current(ac, EOK, 12);
+	if (!ac->tmo_id) ata_sm_arm(ac);
 	splx(s);
-	ide_kick(ac);
-        	return;
-}
-splx(s);
-
 }
 
 void
@@ -192,12 +157,18 @@ ide_kick_internal(ata_ctrl_t *ac)
 		return;
 	}
 
-        if (do_start) ide_start(ac);
+        if (do_start) ide_start(ac, !AC_HAS_FLAG(ac,ACF_IN_ISR));
 
-	/* Drive synchronously in POLLMODE */
-	if (!AC_HAS_FLAG(ac, ACF_INTR_MODE) && 
-	     AC_HAS_FLAG(ac, ACF_BUSY))
+	if (AC_HAS_FLAG(ac, ACF_INTR_MODE)) {
+		/* ide_start() only issued the command: take it from here */
+		s = splbio();
+		if (do_start && q->cur)
+			ata_sm_run(ac, q->cur, ata_sm_sample(ac), ATA_EV_POLL);
+		splx(s);
+	} else if (AC_HAS_FLAG(ac, ACF_BUSY)) {
+		/* Drive synchronously in POLLMODE */
 		ide_poll_engine(ac);
+	}
 }
 
 void
@@ -218,8 +189,14 @@ ide_kick(ata_ctrl_t *ac)
 	ide_kick_internal(ac);
 }
 
+/*
+ * Pop the next request and issue its first command, nothing more:
+ * the caller steps it (ata_sm_run(), ide_poll_engine()), or its
+ * interrupt or tick does.  hy: the caller steps it at once, so the
+ * command may be set up for a hybrid spin.
+ */
 void
-ide_start(ata_ctrl_t *ac)
+ide_start(ata_ctrl_t *ac, int hy)
 {
 	ata_ioque_t *q = ac->ioque;
 	ata_req_t   *r = q ? q->q_head : NULL;
@@ -232,8 +209,7 @@ ide_start(ata_ctrl_t *ac)
 		Cstr(ac), r ? r->reqid : 0, ac->nreq, q->cur, ast, ac->flags);
 
         s = splbio();
-	if (AC_HAS_FLAG(ac,ACF_BUSY) || 
-	    AC_HAS_FLAG(ac,ACF_CLOSING) || q->cur) { splx(s); return; }
+	if (AC_HAS_FLAG(ac,ACF_BUSY) || q->cur) { splx(s); return; }
 
         /* pop from queue */
 	r=ide_q_get(ac);
@@ -242,28 +218,41 @@ ide_start(ata_ctrl_t *ac)
 		return;
 	}
 
+	if (r->cmd == ATA_CMD_PACKET)
+		ata_bounce_get(ac);
+
         q->cur   = r;
-	q->state = AS_PRIMING;
-	r->await_drq_ticks = HZ * 2;
+	q->state = (r->cmd == ATA_CMD_PACKET) ? AS_PACKET : AS_ISSUE;
 	AC_SET_FLAG(ac,ACF_BUSY); 
 
 	r->lba_cur 	= r->lba;
 	r->sectors_left	= r->nsec;
 	r->chunk_left	= 0;
 	r->xfer_off	= 0;
+
+	r->prev_state	= q->state;
+	r->prev_chunk_left = r->prev_sectors_left = 0;
+	r->wd_progress	= lbolt;
 	
 	ATADEBUG(5,"Req=%ld lba=%lu nsec=%lu addr=%lx - lba_cur=%lu secleft=%lu chunkleft=%lu xoff=%lu chunk_bytes=%lu\n",
 			r->reqid,
-			r->lba,
+			ATA_LBA_LO(r->lba),
 			r->nsec,
 			r->addr,
-			r->lba_cur,
+			ATA_LBA_LO(r->lba_cur),
 			r->sectors_left,
 			r->chunk_left,
 			r->xfer_off,
 			r->chunk_bytes);
 
-	ata_program_next_chunk(ac,r,HZ/8);
+	if (q->state == AS_PACKET) {
+		ata_program_next_chunk(ac,r,HZ/8);
+	} else {
+		/* Left in ISSUE if nothing went out; ata_sm_issue() decides */
+		if (hy) r->flags |= ATA_RF_HYOK;
+		(void)ata_program_next_chunk(ac,r,0);
+		ata_sm_arm(ac);
+	}
 	splx(s);
 	return;
 }